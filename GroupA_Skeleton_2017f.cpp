@@ -2,7 +2,21 @@
 #define _USE_MATH_DEFINES
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
+#include <time.h>
+#include <ratio>
+#include <type_traits>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
 
 #if defined(__APPLE__)
 #include <GLUT/GLUT.h>
@@ -18,7 +32,7 @@
 
 const unsigned int windowWidth = 512, windowHeight = 512;
 
-bool keyboardState[256];
+bool keyboardState[256];	// keys held, for the camera on the GLUT thread; the scene gets InputEvents
 double t;
 
 // OpenGL major and minor versions
@@ -153,7 +167,7 @@ public:
 	Shader() {}
 
 
-	~Shader() {
+	virtual ~Shader() {
 		//glDeleteProgram(shaderProgram);
 	}
 
@@ -388,555 +402,4307 @@ public:
 };
 
 
+// compile-time sine for the shape tables, Taylor series after range reduction to [-pi, pi]
+constexpr double constexprSin(double x)
+{
+	while (x > M_PI) x -= 2 * M_PI;
+	while (x < -M_PI) x += 2 * M_PI;
+	double term = x, sum = x;
+	for (int n = 1; n < 14; n++)
+	{
+		term *= -x * x / ((2 * n) * (2 * n + 1));
+		sum += term;
+	}
+	return sum;
+}
+
+constexpr double constexprCos(double x)
+{
+	return constexprSin(x + M_PI / 2);
+}
+
+// shape parameters of every gem type, indexed by object ID (0 is unused)
+enum ShapeCurve { CURVE_POLYGON = 0, CURVE_HEART = 1, CURVE_TRIANGLE = 2 };
+
+const int gemShapeCount = 7;
+
+// inner radius of the five-pointed star, sin(pi / 10) / sin(3 * pi / 10) rounded to nine digits
+typedef std::ratio<(long long)(constexprSin(M_PI / 10) / constexprSin(3 * M_PI / 10) * 1000000000 + 0.5), 1000000000> starRatio;
+
+struct GemShape
+{
+	int curve;			// polygon/star, heart or the right triangle
+	int segments;		// triangles in the fan around the center
+	float innerRatio;	// radius of every odd rim vertex, 1 for plain polygons
+	float spin;			// degrees turned every simulation tick, on top of the cell's orientation
+	vec4 color;
+};
+
+const GemShape gemShapes[gemShapeCount] = {
+	{ CURVE_POLYGON, 0, 1, 0, vec4(0, 0, 0) },
+	{ CURVE_TRIANGLE, 1, 1, 0, vec4(1, 0.5, 0) },		// Triangle
+	{ CURVE_POLYGON, 4, 1, 0, vec4(0.3, 1, 0) },		// Quad
+	{ CURVE_POLYGON, 10, (float)starRatio::num / starRatio::den, 0, vec4(0.6, 0, 1) },	// Stellar
+	{ CURVE_POLYGON, 5, 1, 0.05f, vec4(0.54, 1, 1) },	// Pentagon
+	{ CURVE_POLYGON, 6, 1, 0, vec4(1, 1, 1) },			// Hexagon
+	{ CURVE_HEART, 50, 1, 0, vec4(0.5, 0, 1) },		// Heart
+};
+
+// every spin turns a whole number of times in this many ticks, so renderers
+// take the tick modulo it and float keeps the angle exact
+const int spinPeriod = 7200;
+
+// the spin of a gem type at a tick, in degrees
+inline float spinAngle(int ID, long long tick) {
+	return gemShapes[ID].spin * (float)(tick % spinPeriod);
+}
+
+// the shape table is constant, shaders reading it get it once after linking
+void uploadGemShapes(unsigned int program)
+{
+	int curves[gemShapeCount], segments[gemShapeCount];
+	float innerRatios[gemShapeCount], spins[gemShapeCount], colors[gemShapeCount * 3];
+	for (int i = 0; i < gemShapeCount; i++)
+	{
+		curves[i] = gemShapes[i].curve;
+		segments[i] = gemShapes[i].segments;
+		innerRatios[i] = gemShapes[i].innerRatio;
+		spins[i] = gemShapes[i].spin;
+		for (int c = 0; c < 3; c++) colors[i * 3 + c] = gemShapes[i].color.v[c];
+	}
+	glUseProgram(program);
+	glUniform1iv(glGetUniformLocation(program, "curves"), gemShapeCount, curves);
+	glUniform1iv(glGetUniformLocation(program, "segments"), gemShapeCount, segments);
+	glUniform1fv(glGetUniformLocation(program, "innerRatios"), gemShapeCount, innerRatios);
+	glUniform1fv(glGetUniformLocation(program, "spins"), gemShapeCount, spins);	// not every shader reads it
+	glUniform3fv(glGetUniformLocation(program, "colors"), gemShapeCount, colors);
+}
+
+
+// builds gem shapes in the vertex shader from gl_VertexID and gl_InstanceID,
+// so the board needs no vertex buffers at all. Every draw holds cells of one gem type.
+class proceduralShader : public Shader {
+
+	unsigned int shaderProgram;
+	int cellsLocation;
+	int typeLocation;
+	int heartSegmentsLocation;	// segments[] of the heart, -1 if the table has none
+
+public:
+	// cells uploaded per instanced draw, kept small enough for the uniform limits of GL 4.1
+	static const int batchSize = 64;
+
+	proceduralShader() {
+		CompileShader();
+	}
+
+	~proceduralShader() {
+		glDeleteProgram(shaderProgram);
+	}
+
+	void CompileShader() {
+
+		const char *vertexSource = R"(
+        #version 410
+        precision highp float;
+
+        const float PI = 3.14159265358979;
+        const int batchSize = 64;
+        const int shapeCount = 7;
+
+        uniform vec4 cells[batchSize];		// position.x, position.y, scale, orientation in degrees
+        uniform int type;					// object ID of every cell in the draw
+        uniform int curves[shapeCount];
+        uniform int segments[shapeCount];
+        uniform float innerRatios[shapeCount];
+        uniform vec3 colors[shapeCount];
+        uniform mat4 M;						// view transformation
+        uniform float time;
+        out vec3 color;
+
+        vec2 rim(int type, int k)
+        {
+            if (curves[type] == 1)			// heart
+            {
+                float a = 2 * PI * (k + 2) / segments[type];
+                float s = sin(a);
+                return vec2(16 * s * s * s,
+                    13 * cos(a) - 5 * cos(2 * a) - 2 * cos(3 * a) - cos(4 * a)) / 24;
+            }
+            float a = PI / 2 + 2 * PI * k / segments[type];
+            float r = (k % 2 == 1) ? innerRatios[type] * 0.75 : 0.75;
+            return vec2(cos(a), sin(a)) * r;
+        }
+
+        void main()
+        {
+            int triangle = gl_VertexID / 3;
+            int corner = gl_VertexID % 3;
+
+            vec2 p;
+            if (curves[type] == 2) p = vec2(corner == 2 ? -0.5 : corner - 0.5, corner == 2 ? 0.5 : -0.5);
+            else if (corner == 0) p = vec2(0, 0);
+            else p = rim(type, triangle + corner - 1);
+
+            vec4 cell = cells[gl_InstanceID];
+            float o = radians(cell.w);
+            p = p * cell.z;
+            p = vec2(p.x * cos(o) - p.y * sin(o), p.x * sin(o) + p.y * cos(o)) + cell.xy;
+
+            color = colors[type];
+            if (curves[type] == 1) color = vec3(color.r * time, 0, 0);
+            gl_Position = vec4(p.x, p.y, 0, 1) * M;
+        }
+        )";
+
+		// fragment shader in GLSL
+		const char *fragmentSource = R"(
+        #version 410
+        precision highp float;
+
+        in vec3 color;			// variable input: interpolated from the vertex colors
+        out vec4 fragmentColor;		// output that goes to the raster memory as told by glBindFragDataLocation
+
+        void main()
+        {
+            fragmentColor = vec4(color, 1); // extend RGB to RGBA
+        }
+        )";
+
+
+		// create vertex shader from string
+		unsigned int vertexShader = glCreateShader(GL_VERTEX_SHADER);
+		if (!vertexShader) { printf("Error in vertex shader creation\n"); exit(1); }
+
+		glShaderSource(vertexShader, 1, &vertexSource, NULL);
+		glCompileShader(vertexShader);
+		checkShader(vertexShader, "Vertex shader error");
+
+		// create fragment shader from string
+		unsigned int fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
+		if (!fragmentShader) { printf("Error in fragment shader creation\n"); exit(1); }
+
+		glShaderSource(fragmentShader, 1, &fragmentSource, NULL);
+		glCompileShader(fragmentShader);
+		checkShader(fragmentShader, "Fragment shader error");
+
+		// attach shaders to a single program
+		shaderProgram = glCreateProgram();
+		if (!shaderProgram) { printf("Error in shader program creation\n"); exit(1); }
+
+		glAttachShader(shaderProgram, vertexShader);
+		glAttachShader(shaderProgram, fragmentShader);
+
+		// connect the fragmentColor to the frame buffer memory
+		glBindFragDataLocation(shaderProgram, 0, "fragmentColor");
+
+		glLinkProgram(shaderProgram);
+		checkLinking(shaderProgram);
+
+		cellsLocation = glGetUniformLocation(shaderProgram, "cells");
+		typeLocation = glGetUniformLocation(shaderProgram, "type");
+		heartSegmentsLocation = -1;
+		for (int i = 0; i < gemShapeCount; i++)
+			if (gemShapes[i].curve == CURVE_HEART)
+			{
+				char name[32];
+				snprintf(name, sizeof name, "segments[%d]", i);
+				heartSegmentsLocation = glGetUniformLocation(shaderProgram, name);
+			}
+
+		uploadGemShapes(shaderProgram);
+	}
+
+
+	void UploadColor(vec4& color) {}
+
+	void UploadM(mat4& M) {
+		int location = glGetUniformLocation(shaderProgram, "M");
+		if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, M);
+		else printf("uniform M (procedural) cannot be set\n");
+	}
+
+	void UploadTime(double t) {
+		int location = glGetUniformLocation(shaderProgram, "time");
+		if (location >= 0) glUniform1f(location, (float)t);
+		else printf("uniform time (procedural) cannot be set\n");
+	}
+
+	void UploadHeartSegments(int heartSegments) {
+		if (heartSegmentsLocation >= 0) glUniform1i(heartSegmentsLocation, heartSegments);
+	}
+
+	// cells: count * (x, y, scale, orientation), all of them of the given object ID
+	void UploadCells(float* cells, int type, int count) {
+		glUniform4fv(cellsLocation, count, cells);
+		glUniform1i(typeLocation, type);
+	}
+
+
+	void Run() {
+		glUseProgram(shaderProgram);
+	}
+
+
+};
+
+
+// draws the whole board in one full-screen pass from an integer texture with
+// one texel per cell, so the cost depends on the pixel count and not on the cell count
+class textureBoardShader : public Shader {
+
+	unsigned int shaderProgram;
+
+public:
+	textureBoardShader() {
+		CompileShader();
+	}
+
+	~textureBoardShader() {
+		glDeleteProgram(shaderProgram);
+	}
+
+	void CompileShader() {
+
+		const char *vertexSource = R"(
+        #version 410
+        precision highp float;
+
+        out vec2 ndc;
+        void main()
+        {
+            // a single triangle covering the viewport
+            ndc = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2) * 2 - 1;
+            gl_Position = vec4(ndc, 0, 1);
+        }
+        )";
+
+		// fragment shader in GLSL
+		const char *fragmentSource = R"(
+        #version 410
+        precision highp float;
+
+        const float PI = 3.14159265358979;
+        const int shapeCount = 7;
+
+        uniform usampler2D board;			// r: object ID, g: scale, b: orientation
+        uniform ivec2 gridSize;
+        uniform vec2 boardOrigin;
+        uniform float cellSize;
+        uniform float gemOffset;			// gem center relative to the cell corner
+        uniform float scaleRange;			// scale stored as 255
+        uniform int curves[shapeCount];
+        uniform int segments[shapeCount];
+        uniform float innerRatios[shapeCount];
+        uniform float spins[shapeCount];	// degrees a tick
+        uniform vec3 colors[shapeCount];
+        uniform mat4 invV;					// inverse view transformation
+        uniform float time;
+        uniform float ticks;				// modulo the spin period
+        in vec2 ndc;
+        out vec4 fragmentColor;
+
+        vec2 rim(int type, int k)
+        {
+            float a = PI / 2 + 2 * PI * k / segments[type];
+            float r = (k % 2 == 1) ? innerRatios[type] * 0.75 : 0.75;
+            return vec2(cos(a), sin(a)) * r;
+        }
+
+        bool inside(int type, vec2 p)
+        {
+            if (curves[type] == 2) return p.x >= -0.5 && p.y >= -0.5 && p.x + p.y <= 0;
+            if (curves[type] == 1)
+            {
+                // implicit heart fitted over the parametric one of the vertex shaders
+                vec2 q = p * 1.86 + vec2(0, 0.32);
+                float a = dot(q, q) - 1;
+                return a * a * a - q.x * q.x * q.y * q.y * q.y <= 0;
+            }
+            // the fan triangle of the sector holding p
+            float a = mod(atan(p.y, p.x) - PI / 2, 2 * PI);
+            int k = min(int(a / (2 * PI / segments[type])), segments[type] - 1);
+            vec2 r0 = rim(type, k);
+            vec2 e = rim(type, k + 1) - r0;
+            vec2 d = p - r0;
+            return e.x * d.y - e.y * d.x >= 0;
+        }
+
+        void main()
+        {
+            vec2 world = (vec4(ndc, 0, 1) * invV).xy;
+            ivec2 cell = ivec2(floor((world - boardOrigin) / cellSize));
+            if (any(lessThan(cell, ivec2(0))) || any(greaterThanEqual(cell, gridSize))) discard;
+
+            uvec4 texel = texelFetch(board, cell, 0);
+            int type = int(texel.r);
+            float scale = float(texel.g) / 255 * scaleRange;
+            if (type == 0 || type >= shapeCount || scale <= 0) discard;
+
+            // back to the shape's own coordinates
+            float o = radians(float(texel.b) / 256 * 360 + spins[type] * ticks);
+            vec2 p = world - (boardOrigin + vec2(cell) * cellSize + gemOffset);
+            p = vec2(p.x * cos(o) + p.y * sin(o), p.y * cos(o) - p.x * sin(o)) / scale;
+            if (!inside(type, p)) discard;
+
+            vec3 color = colors[type];
+            if (curves[type] == 1) color = vec3(color.r * time, 0, 0);
+            fragmentColor = vec4(color, 1);
+        }
+        )";
+
+
+		// create vertex shader from string
+		unsigned int vertexShader = glCreateShader(GL_VERTEX_SHADER);
+		if (!vertexShader) { printf("Error in vertex shader creation\n"); exit(1); }
+
+		glShaderSource(vertexShader, 1, &vertexSource, NULL);
+		glCompileShader(vertexShader);
+		checkShader(vertexShader, "Vertex shader error");
+
+		// create fragment shader from string
+		unsigned int fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
+		if (!fragmentShader) { printf("Error in fragment shader creation\n"); exit(1); }
+
+		glShaderSource(fragmentShader, 1, &fragmentSource, NULL);
+		glCompileShader(fragmentShader);
+		checkShader(fragmentShader, "Fragment shader error");
+
+		// attach shaders to a single program
+		shaderProgram = glCreateProgram();
+		if (!shaderProgram) { printf("Error in shader program creation\n"); exit(1); }
+
+		glAttachShader(shaderProgram, vertexShader);
+		glAttachShader(shaderProgram, fragmentShader);
+
+		// connect the fragmentColor to the frame buffer memory
+		glBindFragDataLocation(shaderProgram, 0, "fragmentColor");
+
+		glLinkProgram(shaderProgram);
+		checkLinking(shaderProgram);
+
+		uploadGemShapes(shaderProgram);
+		glUniform1i(glGetUniformLocation(shaderProgram, "board"), 0);	// texture unit 0
+	}
+
+
+	void UploadColor(vec4& color) {}
+
+	// the full-screen pass maps pixels back to the board, so it needs the inverse view transformation
+	void UploadM(mat4& invV) {
+		int location = glGetUniformLocation(shaderProgram, "invV");
+		if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, invV);
+		else printf("uniform invV (board texture) cannot be set\n");
+	}
+
+	void UploadTime(double t) {
+		int location = glGetUniformLocation(shaderProgram, "time");
+		if (location >= 0) glUniform1f(location, (float)t);
+		else printf("uniform time (board texture) cannot be set\n");
+	}
+
+	void UploadTicks(long long tick) {
+		int location = glGetUniformLocation(shaderProgram, "ticks");
+		if (location >= 0) glUniform1f(location, (float)(tick % spinPeriod));
+		else printf("uniform ticks (board texture) cannot be set\n");
+	}
+
+	void UploadLayout(int width, int height, vec2 origin, float cellSize, float gemOffset, float scaleRange) {
+		glUniform2i(glGetUniformLocation(shaderProgram, "gridSize"), width, height);
+		glUniform2f(glGetUniformLocation(shaderProgram, "boardOrigin"), origin.x, origin.y);
+		glUniform1f(glGetUniformLocation(shaderProgram, "cellSize"), cellSize);
+		glUniform1f(glGetUniformLocation(shaderProgram, "gemOffset"), gemOffset);
+		glUniform1f(glGetUniformLocation(shaderProgram, "scaleRange"), scaleRange);
+	}
+
+
+	void Run() {
+		glUseProgram(shaderProgram);
+	}
+
+
+};
+
+
+// pre-transformed world space triangles with per-vertex colors, used for cached board chunks
+class chunkShader : public Shader {
+
+	unsigned int shaderProgram;
+
+public:
+	chunkShader() {
+		CompileShader();
+	}
+
+	~chunkShader() {
+		glDeleteProgram(shaderProgram);
+	}
+
+	void CompileShader() {
+
+		const char *vertexSource = R"(
+        #version 410
+        precision highp float;
+
+        in vec2 vertexPosition;		// world position from Attrib Array 0
+        in vec4 vertexColor;		// rgb and the heart beat flag from Attrib Array 1
+        in vec3 vertexSpin;			// gem center and degrees a tick from Attrib Array 2, 0 if unset
+        uniform vec3 tint;
+        uniform mat4 M;				// view transformation
+        uniform float time;
+        uniform float ticks;		// modulo the spin period
+        out vec3 color;
+        void main()
+        {
+            color = vertexColor.a > 0.5 ? vec3(vertexColor.r * time, 0, 0) : vertexColor.rgb;
+            color = color * tint;
+            float a = radians(vertexSpin.z * ticks);
+            vec2 p = vertexPosition - vertexSpin.xy;
+            p = vec2(p.x * cos(a) - p.y * sin(a), p.x * sin(a) + p.y * cos(a)) + vertexSpin.xy;
+            gl_Position = vec4(p.x, p.y, 0, 1) * M;
+        }
+        )";
+
+		// fragment shader in GLSL
+		const char *fragmentSource = R"(
+        #version 410
+        precision highp float;
+
+        in vec3 color;			// variable input: interpolated from the vertex colors
+        out vec4 fragmentColor;		// output that goes to the raster memory as told by glBindFragDataLocation
+
+        void main()
+        {
+            fragmentColor = vec4(color, 1); // extend RGB to RGBA
+        }
+        )";
+
+
+		// create vertex shader from string
+		unsigned int vertexShader = glCreateShader(GL_VERTEX_SHADER);
+		if (!vertexShader) { printf("Error in vertex shader creation\n"); exit(1); }
+
+		glShaderSource(vertexShader, 1, &vertexSource, NULL);
+		glCompileShader(vertexShader);
+		checkShader(vertexShader, "Vertex shader error");
+
+		// create fragment shader from string
+		unsigned int fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
+		if (!fragmentShader) { printf("Error in fragment shader creation\n"); exit(1); }
+
+		glShaderSource(fragmentShader, 1, &fragmentSource, NULL);
+		glCompileShader(fragmentShader);
+		checkShader(fragmentShader, "Fragment shader error");
+
+		// attach shaders to a single program
+		shaderProgram = glCreateProgram();
+		if (!shaderProgram) { printf("Error in shader program creation\n"); exit(1); }
+
+		glAttachShader(shaderProgram, vertexShader);
+		glAttachShader(shaderProgram, fragmentShader);
+
+		// connect Attrib Arrays to input variables of the vertex shader
+		glBindAttribLocation(shaderProgram, 0, "vertexPosition");
+		glBindAttribLocation(shaderProgram, 1, "vertexColor");
+		glBindAttribLocation(shaderProgram, 2, "vertexSpin");
+
+		// connect the fragmentColor to the frame buffer memory
+		glBindFragDataLocation(shaderProgram, 0, "fragmentColor");
+
+		glLinkProgram(shaderProgram);
+		checkLinking(shaderProgram);
+	}
+
+
+	void UploadColor(vec4& color) {
+		int location = glGetUniformLocation(shaderProgram, "tint");
+		if (location >= 0) glUniform3fv(location, 1, &color.v[0]);
+		else printf("uniform tint (chunk) cannot be set\n");
+	}
+
+	void UploadM(mat4& M) {
+		int location = glGetUniformLocation(shaderProgram, "M");
+		if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, M);
+		else printf("uniform M (chunk) cannot be set\n");
+	}
+
+	void UploadTime(double t) {
+		int location = glGetUniformLocation(shaderProgram, "time");
+		if (location >= 0) glUniform1f(location, (float)t);
+		else printf("uniform time (chunk) cannot be set\n");
+	}
+
+	void UploadTicks(long long tick) {
+		int location = glGetUniformLocation(shaderProgram, "ticks");
+		if (location >= 0) glUniform1f(location, (float)(tick % spinPeriod));
+		else printf("uniform ticks (chunk) cannot be set\n");
+	}
+
+
+	void Run() {
+		glUseProgram(shaderProgram);
+	}
+
+
+};
+
+
 class Camera
 {
-    vec2 center;
-    vec2 halfSize;
-	float orientation;
-	bool b;
+    vec2 center;
+    vec2 halfSize;
+	float orientation;
+	bool b;
+	unsigned int revision;	// bumped whenever the view transformation changes
+	int viewportHeight;
+
+public:
+    Camera()
+    {
+        center = vec2(0.0, 0.0);
+        halfSize =  vec2(1.0, 1.0);
+		orientation = 0.0;
+		b = false;
+		revision = 0;
+		viewportHeight = windowHeight;
+    }
+
+	unsigned int getRevision() {
+		return revision;
+	}
+
+    mat4 GetViewTransformationMatrix()
+    {
+		float orientation_rad = orientation / 180 * M_PI;
+        mat4 T = mat4(
+                      1.0, 0.0, 0.0, 0.0,
+                      0.0, 1.0, 0.0, 0.0,
+                      0.0, 0.0, 1.0, 0.0,
+                      -center.x, -center.y, 0.0, 1.0);
+
+        mat4 S = mat4(
+                      1.0 / halfSize.x, 0.0, 0.0, 0.0,
+                      0.0, 1.0 / halfSize.y, 0.0, 0.0,
+                      0.0, 0.0, 1.0, 0.0,
+                      0.0, 0.0, 0.0, 1.0);
+			mat4 R = mat4(cos(orientation_rad), sin(orientation_rad), 0, 0,
+				-sin(orientation_rad), cos(orientation_rad), 0, 0,
+				0, 0, 1, 0,
+				0, 0, 0, 1);
+		
+
+        return T * R * S;
+    }
+
+	mat4 getInverseViewTransformationMatrix() {
+
+		float orientation_rad = orientation / 180 * M_PI;
+		mat4 T = mat4(
+			1.0, 0.0, 0.0, 0.0,
+			0.0, 1.0, 0.0, 0.0,
+			0.0, 0.0, 1.0, 0.0,
+			center.x, center.y, 0.0, 1.0);
+
+		mat4 S = mat4(
+			1.0 * halfSize.x, 0.0, 0.0, 0.0,
+			0.0, 1.0 * halfSize.y, 0.0, 0.0,
+			0.0, 0.0, 1.0, 0.0,
+			0.0, 0.0, 0.0, 1.0);
+		mat4 R = mat4(cos(-orientation_rad), sin(-orientation_rad), 0, 0,
+			sin(orientation_rad), cos(-orientation_rad), 0, 0,
+			0, 0, 1, 0,
+			0, 0, 0, 1);
+
+		return S * R * T;
+	}
+
+    // halfSize.y is the zoom, the aspect ratio only stretches x
+    void SetAspectRatio(int width, int height)
+    {
+        halfSize = vec2((float)width / height * halfSize.y, halfSize.y);
+		viewportHeight = height;
+		revision++;
+    }
+
+	// screen pixels per world unit at the current zoom
+	float getPixelsPerUnit() {
+		return viewportHeight / (2 * halfSize.y);
+	}
+
+	vec2 getHalfSize() {
+		return halfSize;
+	}
+
+	// axis aligned bounding box of the viewport in world coordinates
+	void getVisibleRect(vec2& min, vec2& max) {
+		mat4 invV = getInverseViewTransformationMatrix();
+		for (int k = 0; k < 4; k++)
+		{
+			vec4 corner = vec4((k & 1) ? 1 : -1, (k & 2) ? 1 : -1, 0, 1) * invV;
+			if (k == 0 || corner.v[0] < min.x) min.x = corner.v[0];
+			if (k == 0 || corner.v[1] < min.y) min.y = corner.v[1];
+			if (k == 0 || corner.v[0] > max.x) max.x = corner.v[0];
+			if (k == 0 || corner.v[1] > max.y) max.y = corner.v[1];
+		}
+	}
+
+    void Move(float dt)
+    {
+        if(keyboardState['j']) center = center + vec2(1.0 , 0.0) * dt;
+        if(keyboardState['l']) center = center + vec2(-1.0, 0.0) * dt;
+        if(keyboardState['k']) center = center + vec2(0.0, 1.0) * dt;
+        if(keyboardState['i']) center = center + vec2(0.0, -1.0) * dt;
+		if (keyboardState['z']) Zoom(exp(-dt));
+		if (keyboardState['x']) Zoom(exp(dt));
+		if (keyboardState['j'] || keyboardState['l'] || keyboardState['k'] || keyboardState['i']) revision++;
+	}
+
+	// scales the visible area, factors below 1 zoom in
+	void Zoom(float factor) {
+		float y = halfSize.y * factor;
+		if (y < 0.01) y = 0.01;
+		if (y > 100.0) y = 100.0;
+		halfSize = vec2(halfSize.x / halfSize.y * y, y);
+		revision++;
+	}
+
+	void Quake(float dt) {
+		center = center + vec2(0.001, 0.0) * dt; 
+		revision++;
+	}
+
+	void rotateCamClock() {
+
+		if (!b) {
+			orientation += M_PI/2;
+			b = true;
+			revision++;
+		}
+	}
+
+	void rotateCamCount() {
+
+		if (!b) {
+			orientation -= M_PI/2;
+			b = true;
+			revision++;
+		}
+	}
+
+
+	void reset() {
+		b = false;
+	}
+
+	
+};
+
+Camera camera;
+
+
+class Geometry
+{
+protected:
+	unsigned int vao;
+	const float* fan;	// CPU copy of the triangle fan, x and y per vertex, if the shape has one
+	int fanCount;
+
+public:
+	virtual void Draw() = 0;
+	Geometry()
+	{
+		glGenVertexArrays(1, &vao);
+		fan = 0;
+		fanCount = 0;
+	}
+
+	virtual ~Geometry() {}
+
+	virtual const float* getFan() {
+		return fan;
+	}
+
+	virtual int getFanCount() {
+		return fanCount;
+	}
+};
+
+
+class Material
+{
+	Shader* shader;
+	vec4 color;
+
+public:
+	Material(Shader* shader, vec4 color)
+	{
+		this->shader = shader;
+		this->color = color;
+	}
+
+	void UploadAttributes()
+	{
+		shader->UploadColor(color);
+	}
+};
+
+
+
+class Mesh
+{
+	Geometry* geometry;
+	Material* material;
+
+public:
+	Mesh(Geometry* geometry, Material* material)
+	{
+		this->material = material;
+		this->geometry = geometry;
+	}
+
+	void Draw()
+	{
+		material->UploadAttributes();
+		geometry->Draw();
+	}
+};
+
+class Object
+{
+	Shader* shader;
+	Mesh* mesh;
+	vec2 position;
+	vec2 scaling;
+	float orientation;
+	int ID;
+	bool d;
+
+public:
+	Object(Shader* shader, Mesh* mesh, vec2 position, vec2 scaling, float orientation, int ID)
+	{
+		this->shader = shader;
+		this->mesh = mesh;
+		this->position = position;
+		this->scaling = scaling;
+		this->orientation = orientation;
+		this->ID = ID;
+		d = false;
+	}
+
+	void UploadAttributes()
+	{
+		mat4 S = mat4(scaling.x, 0, 0, 0,
+			0, scaling.y, 0, 0,
+			0, 0, 1, 0,
+			0, 0, 0, 1);
+		float orientation_rad = (orientation * M_PI) / 180;
+		mat4 R = mat4(cos(orientation_rad), sin(orientation_rad), 0, 0,
+			-sin(orientation_rad), cos(orientation_rad), 0, 0,
+			0, 0, 1, 0,
+			0, 0, 0, 1);
+		mat4 T = mat4(1, 0, 0, 0,
+			0, 1, 0, 0,
+			0, 0, 1, 0,
+			position.x, position.y, 0, 1);
+		mat4 V = camera.GetViewTransformationMatrix();
+
+		mat4 M = S * R * T * V; // scaling, rotation, and translation
+
+		shader->UploadM(M);
+	}
+
+
+	int getID() {
+		return ID;
+	}
+
+	vec2 getScale() {
+		return scaling;
+	}
+
+	void Scale(float dt) {
+		scaling.x = scaling.x *dt;
+		scaling.y = scaling.y * dt;
+	}
+
+	vec2 getPosition() {
+		return position;
+	}
+
+	void setPosition(vec2 position) {
+		this->position = position;
+	}
+
+	float getOrientation() {
+		return orientation;
+	}
+
+	void setOrientation(float orientation) {
+		this->orientation = orientation;
+	}
+
+	void Rotate(float dt) {
+		orientation += 0.1 * dt;
+	}
+
+	void DeleteBlock() {
+		d = true;
+	}
+
+	bool isDeleted() {
+		return d;
+	}
+
+	// reuses the object for a new gem
+	void Reset(Shader* shader, Mesh* mesh, vec2 position, vec2 scaling, int ID) {
+		this->shader = shader;
+		this->mesh = mesh;
+		this->position = position;
+		this->scaling = scaling;
+		this->orientation = 0;
+		this->ID = ID;
+		d = false;
+	}
+
+	void CheckD() {
+		if (d) {
+			Scale(0.999);
+			Rotate(-4);
+		}
+	}
+
+	void Draw()
+	{
+		UploadAttributes();
+		mesh->Draw();
+	}
+};
+
+
+# include <vector>
+
+class Triangle : public Geometry
+{
+	unsigned int vbo;	// vertex array object id
+
+public:
+	Triangle()
+	{
+		glBindVertexArray(vao);		// make it active
+
+		glGenBuffers(1, &vbo);		// generate a vertex buffer object
+
+									// vertex coordinates: vbo -> Attrib Array 0 -> vertexPosition of the vertex shader
+		glBindBuffer(GL_ARRAY_BUFFER, vbo); // make it active, it is an array
+		static float vertexCoords[] = { -0.5, -0.5, 0.5, -0.5, -0.5, 0.5 };	// vertex data on the CPU
+
+		glBufferData(GL_ARRAY_BUFFER,	// copy to the GPU
+			sizeof(vertexCoords),	// size of the vbo in bytes
+			vertexCoords,		// address of the data array on the CPU
+			GL_STATIC_DRAW);	// copy to that part of the memory which is not modified
+		fan = vertexCoords;
+		fanCount = 3;
+
+								// map Attribute Array 0 to the currently bound vertex buffer (vbo)
+		glEnableVertexAttribArray(0);
+
+		// data organization of Attribute Array 0
+		glVertexAttribPointer(0,	// Attribute Array 0
+			2, GL_FLOAT,		// components/attribute, component type
+			GL_FALSE,		// not in fixed point format, do not normalized
+			0, NULL);		// stride and offset: it is tightly packed
+	}
+
+	void Draw()
+	{
+		glBindVertexArray(vao);	// make the vao and its vbos active playing the role of the data source
+		glDrawArrays(GL_TRIANGLES, 0, 3); // draw a single triangle with vertices defined in vao
+	}
+};
+
+// triangle fan coordinates, x and y per vertex, the center first
+template<int N>
+struct ShapeTable
+{
+	float v[N * 2];
+};
+
+// regular polygon starting at the top, the first rim vertex repeated to close the fan
+template<int Sides, class Radius>
+constexpr ShapeTable<Sides + 2> makePolygon()
+{
+	ShapeTable<Sides + 2> table = {};
+	double r = (double)Radius::num / Radius::den;
+	for (int i = 0; i <= Sides; i++)
+	{
+		double A = M_PI / 2 + 2 * M_PI * i / Sides;
+		table.v[(i + 1) * 2] = (float)(constexprCos(A) * r);
+		table.v[(i + 1) * 2 + 1] = (float)(constexprSin(A) * r);
+	}
+	return table;
+}
+
+// star with every second rim vertex pulled in to InnerRatio * Radius
+template<int Points, class Radius, class InnerRatio>
+constexpr ShapeTable<Points * 2 + 2> makeStar()
+{
+	ShapeTable<Points * 2 + 2> table = {};
+	double r = (double)Radius::num / Radius::den;
+	double inner = r * InnerRatio::num / InnerRatio::den;
+	for (int i = 0; i <= Points * 2; i++)
+	{
+		double A = M_PI / 2 + M_PI * i / Points;
+		table.v[(i + 1) * 2] = (float)(constexprCos(A) * (i % 2 ? inner : r));
+		table.v[(i + 1) * 2 + 1] = (float)(constexprSin(A) * (i % 2 ? inner : r));
+	}
+	return table;
+}
+
+// the parametric heart sampled Samples times around
+template<int Samples>
+constexpr ShapeTable<Samples + 2> makeHeart()
+{
+	ShapeTable<Samples + 2> table = {};
+	for (int i = 0; i <= Samples; i++)
+	{
+		double A = 2 * (i + 2) * M_PI / Samples;
+		double s = constexprSin(A);
+		table.v[(i + 1) * 2] = (float)(16 * s * s * s / 24);
+		table.v[(i + 1) * 2 + 1] = (float)((13 * constexprCos(A) - 5 * constexprCos(2 * A)
+			- 2 * constexprCos(3 * A) - constexprCos(4 * A)) / 24);
+	}
+	return table;
+}
+
+// the tables live in read-only memory, no trigonometry runs at startup
+template<int Sides, class Radius>
+constexpr ShapeTable<Sides + 2> polygonTable = makePolygon<Sides, Radius>();
+
+template<int Points, class Radius, class InnerRatio>
+constexpr ShapeTable<Points * 2 + 2> starTable = makeStar<Points, Radius, InnerRatio>();
+
+template<int Samples>
+constexpr ShapeTable<Samples + 2> heartTable = makeHeart<Samples>();
+
+// a triangle fan uploaded from a compile-time table
+class FanGeometry : public Geometry
+{
+	unsigned int vbo;
+
+public:
+	template<int N>
+	FanGeometry(const ShapeTable<N>& table)
+	{
+		glBindVertexArray(vao);
+
+		glGenBuffers(1, &vbo);
+
+		glBindBuffer(GL_ARRAY_BUFFER, vbo);
+		glBufferData(GL_ARRAY_BUFFER,	// copy to the GPU
+			sizeof(table.v),	// size of the vbo in bytes
+			table.v,		// address of the data array on the CPU
+			GL_STATIC_DRAW);	// copy to that part of the memory which is not modified
+		fan = table.v;
+		fanCount = N;
+
+		// map Attribute Array 0 to the currently bound vertex buffer (vbo)
+		glEnableVertexAttribArray(0);
+
+		// data organization of Attribute Array 0
+		glVertexAttribPointer(0,	// Attribute Array 0
+			2, GL_FLOAT,		// components/attribute, component type
+			GL_FALSE,		// not in fixed point format, do not normalized
+			0, NULL);		// stride and offset: it is tightly packed
+	}
+
+	~FanGeometry()
+	{
+		glDeleteBuffers(1, &vbo);
+	}
+
+	void Draw()
+	{
+		glBindVertexArray(vao);	// make the vao and its vbos active playing the role of the data source
+		glDrawArrays(GL_TRIANGLE_FAN, 0, fanCount);
+	}
+};
+
+typedef std::ratio<3, 4> gemRadius;
+
+class Quad : public FanGeometry
+{
+public:
+	Quad() : FanGeometry(polygonTable<4, gemRadius>) {}
+};
+
+class Stellar : public FanGeometry
+{
+public:
+	Stellar() : FanGeometry(starTable<5, gemRadius, starRatio>) {}
+};
+
+class Pentagon : public FanGeometry
+{
+public:
+	Pentagon() : FanGeometry(polygonTable<5, gemRadius>) {}
+};
+
+class Hexagon : public FanGeometry
+{
+public:
+	Hexagon() : FanGeometry(polygonTable<6, gemRadius>) {}
+};
+
+// the heart curve at several levels of detail in one buffer; the level is picked
+// once per frame from the projected gem size, so small gems use a few vertices
+// and close-ups get a smooth curve
+class Heart : public Geometry
+{
+	unsigned int vbo;
+	static int lod;
+
+public:
+	static const int lodCount = 4;
+	static const int lodSamples[lodCount];
+	static const float* const lodFans[lodCount];
+
+	Heart()
+	{
+		glBindVertexArray(vao);
+
+		glGenBuffers(1, &vbo);
+
+		glBindBuffer(GL_ARRAY_BUFFER, vbo);
+		int vertexCount = 0;
+		for (int level = 0; level < lodCount; level++) vertexCount += lodSamples[level] + 2;
+		glBufferData(GL_ARRAY_BUFFER, vertexCount * 2 * sizeof(float), NULL, GL_STATIC_DRAW);
+		for (int level = 0, first = 0; level < lodCount; level++)
+		{
+			glBufferSubData(GL_ARRAY_BUFFER, first * 2 * sizeof(float), (lodSamples[level] + 2) * 2 * sizeof(float), lodFans[level]);
+			first += lodSamples[level] + 2;
+		}
+
+		// map Attribute Array 0 to the currently bound vertex buffer (vbo)
+		glEnableVertexAttribArray(0);
+
+		// data organization of Attribute Array 0
+		glVertexAttribPointer(0,	// Attribute Array 0
+			2, GL_FLOAT,		// components/attribute, component type
+			GL_FALSE,		// not in fixed point format, do not normalized
+			0, NULL);		// stride and offset: it is tightly packed
+	}
+
+	~Heart()
+	{
+		glDeleteBuffers(1, &vbo);
+	}
+
+	// gemPixels: on screen size of a gem of scale 1 in the shape's own coordinates
+	static void SelectLod(float gemPixels)
+	{
+		const float perimeter = 4.26f;		// length of the curve in shape coordinates
+		const float segmentPixels = 3.0f;	// longest rim segment we accept
+		float needed = perimeter * gemPixels / segmentPixels;
+		lod = 0;
+		while (lod < lodCount - 1 && lodSamples[lod] < needed) lod++;
+	}
+
+	static int getSegments() {
+		return lodSamples[lod];
+	}
+
+	const float* getFan() {
+		return lodFans[lod];
+	}
+
+	int getFanCount() {
+		return lodSamples[lod] + 2;
+	}
+
+	void Draw()
+	{
+		int first = 0;
+		for (int level = 0; level < lod; level++) first += lodSamples[level] + 2;
+		glBindVertexArray(vao);	// make the vao and its vbos active playing the role of the data source
+		glDrawArrays(GL_TRIANGLE_FAN, first, lodSamples[lod] + 2);
+	}
+};
+
+int Heart::lod = 2;
+const int Heart::lodSamples[Heart::lodCount] = { 12, 24, 50, 100 };
+const float* const Heart::lodFans[Heart::lodCount] = { heartTable<12>.v, heartTable<24>.v, heartTable<50>.v, heartTable<100>.v };
+
+// an empty vao for proceduralShader: every vertex is computed from gl_VertexID,
+// so new gem types only need a new row in gemShapes. A draw covers one gem type
+// and emits exactly the triangles of its shape.
+class ProceduralShapes : public Geometry
+{
+	int heartSegments;
+
+public:
+	ProceduralShapes() : heartSegments(gemShapes[6].segments) { }
+
+	// the heart follows the level of detail, every other shape has a fixed segment count
+	void SetHeartSegments(int segments)
+	{
+		heartSegments = segments;
+	}
+
+	int getVertexCount(int type)
+	{
+		return 3 * (gemShapes[type].curve == CURVE_HEART ? heartSegments : gemShapes[type].segments);
+	}
+
+	void Draw()
+	{
+		DrawInstances(6, 1);
+	}
+
+	void DrawInstances(int type, int count)
+	{
+		glBindVertexArray(vao);
+		glDrawArraysInstanced(GL_TRIANGLES, 0, getVertexCount(type), count);
+	}
+};
+
+// the board as a GL_RGBA8UI texture for textureBoardShader, one texel per cell:
+// object ID, scale and orientation. A CPU copy finds the cells that really changed,
+// and only those row spans go to the GPU with glTexSubImage2D.
+class BoardTexture : public Geometry
+{
+	unsigned int texture;
+	int width, height;
+	float scaleRange;	// scale values are stored in [0, scaleRange]
+	std::vector<unsigned char> texels;
+	std::vector<int> dirtyFirst, dirtyLast;	// changed columns of every row, first > last if clean
+
+public:
+	BoardTexture(int width, int height, float scaleRange) : width(width), height(height), scaleRange(scaleRange),
+		texels(width * height * 4, 0), dirtyFirst(height, width), dirtyLast(height, -1)
+	{
+		glGenTextures(1, &texture);
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);	// integer textures cannot be filtered
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8UI, width, height, 0, GL_RGBA_INTEGER, GL_UNSIGNED_BYTE, &texels[0]);
+	}
+
+	~BoardTexture()
+	{
+		glDeleteTextures(1, &texture);
+	}
+
+	void SetCell(int i, int j, int ID, float scale, float orientation)
+	{
+		float s = scale / scaleRange * 255 + 0.5f;
+		float o = fmodf(orientation, 360);
+		if (o < 0) o += 360;
+		unsigned char texel[4] = {
+			(unsigned char)ID,
+			(unsigned char)(s > 255 ? 255 : (s < 0 ? 0 : s)),
+			(unsigned char)((int)(o / 360 * 256) & 255),
+			0 };
+
+		unsigned char* p = &texels[(j * width + i) * 4];
+		if (p[0] == texel[0] && p[1] == texel[1] && p[2] == texel[2]) return;
+		p[0] = texel[0]; p[1] = texel[1]; p[2] = texel[2];
+		if (i < dirtyFirst[j]) dirtyFirst[j] = i;
+		if (i > dirtyLast[j]) dirtyLast[j] = i;
+	}
+
+	// uploads the changed span of every row
+	void Flush()
+	{
+		glBindTexture(GL_TEXTURE_2D, texture);
+		for (int j = 0; j < height; j++)
+		{
+			if (dirtyFirst[j] > dirtyLast[j]) continue;
+			glTexSubImage2D(GL_TEXTURE_2D, 0, dirtyFirst[j], j, dirtyLast[j] - dirtyFirst[j] + 1, 1,
+				GL_RGBA_INTEGER, GL_UNSIGNED_BYTE, &texels[(j * width + dirtyFirst[j]) * 4]);
+			dirtyFirst[j] = width;
+			dirtyLast[j] = -1;
+		}
+	}
+
+	void Draw()
+	{
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glBindVertexArray(vao);
+		glDrawArrays(GL_TRIANGLES, 0, 3);	// full-screen triangle
+	}
+};
+
+// a square block of the board baked into one vertex buffer of world space triangles.
+// Cells report their state every frame, and the buffer is rebuilt only when one of
+// them changed shape, position, scale or orientation, so static regions cost one draw.
+// Spinning gems turn in chunkShader, their vertices stay put.
+// SetCell and Build touch no GL state and may run on any thread, one thread per chunk.
+class BoardChunk : public Geometry
+{
+	struct CellState
+	{
+		const float* fan;	// changes with the level of detail too
+		int fanCount;
+		int ID;
+		float x, y, scale, orientation;
+	};
+
+	unsigned int vbo;
+	std::vector<CellState> cells;
+	std::vector<float> vertices;	// x, y, r, g, b, heart beat, center x, center y, spin per vertex
+	int vertexCount;
+	bool dirty;		// vertices are behind the cells
+	bool stale;		// the buffer is behind the vertices
+
+public:
+	static const int size = 32;		// cells per side
+
+	BoardChunk() : cells(size * size), vertexCount(0), dirty(true), stale(false)
+	{
+		for (int k = 0; k < size * size; k++) cells[k].fan = 0;
+
+		glBindVertexArray(vao);
+		glGenBuffers(1, &vbo);
+		glBindBuffer(GL_ARRAY_BUFFER, vbo);
+
+		glEnableVertexAttribArray(0);	// position
+		glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 9 * sizeof(float), NULL);
+		glEnableVertexAttribArray(1);	// color and heart beat flag
+		glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, 9 * sizeof(float), (void*)(2 * sizeof(float)));
+		glEnableVertexAttribArray(2);	// center and spin
+		glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 9 * sizeof(float), (void*)(6 * sizeof(float)));
+	}
+
+	~BoardChunk()
+	{
+		glDeleteBuffers(1, &vbo);
+	}
+
+	// i, j are relative to the chunk corner; geometry 0 leaves the cell empty
+	void SetCell(int i, int j, Geometry* geometry, int ID, vec2 position, float scale, float orientation)
+	{
+		CellState& cell = cells[j * size + i];
+		const float* fan = geometry ? geometry->getFan() : 0;
+		int fanCount = geometry ? geometry->getFanCount() : 0;
+		if (cell.fan == fan && cell.fanCount == fanCount && cell.ID == ID && cell.x == position.x && cell.y == position.y &&
+			cell.scale == scale && cell.orientation == orientation) return;
+
+		cell.fan = fan;
+		cell.fanCount = fanCount;
+		cell.ID = ID;
+		cell.x = position.x;
+		cell.y = position.y;
+		cell.scale = scale;
+		cell.orientation = orientation;
+		dirty = true;
+	}
+
+	bool isDirty() {
+		return dirty;
+	}
+
+	// bakes the cells into vertices, Upload hands them to GL
+	void Build()
+	{
+		vertices.clear();
+		for (int k = 0; k < size * size; k++)
+		{
+			CellState& cell = cells[k];
+			if (!cell.fan) continue;
+
+			const GemShape& shape = gemShapes[cell.ID];
+			float pulse = shape.curve == CURVE_HEART ? 1 : 0;
+			float orientation_rad = (cell.orientation * M_PI) / 180;
+			float c = cos(orientation_rad) * cell.scale, s = sin(orientation_rad) * cell.scale;
+			const float* fan = cell.fan;
+
+			// the fan as separate triangles, scaled, rotated and translated like Object::UploadAttributes
+			for (int f = 1; f + 1 < cell.fanCount; f++)
+			{
+				int corners[3] = { 0, f, f + 1 };
+				for (int v = 0; v < 3; v++)
+				{
+					float x = fan[corners[v] * 2], y = fan[corners[v] * 2 + 1];
+					vertices.push_back(x * c - y * s + cell.x);
+					vertices.push_back(x * s + y * c + cell.y);
+					vertices.push_back(shape.color.v[0]);
+					vertices.push_back(shape.color.v[1]);
+					vertices.push_back(shape.color.v[2]);
+					vertices.push_back(pulse);
+					vertices.push_back(cell.x);
+					vertices.push_back(cell.y);
+					vertices.push_back(shape.spin);
+				}
+			}
+		}
+
+		dirty = false;
+		stale = true;
+	}
+
+	void Upload()
+	{
+		vertexCount = vertices.size() / 9;
+		glBindBuffer(GL_ARRAY_BUFFER, vbo);
+		glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(float), vertexCount ? &vertices[0] : NULL, GL_DYNAMIC_DRAW);
+		stale = false;
+	}
+
+	void Draw()
+	{
+		if (dirty) Build();
+		if (stale) Upload();
+		glBindVertexArray(vao);
+		glDrawArrays(GL_TRIANGLES, 0, vertexCount);
+	}
+};
+
+// static board decoration for chunkShader: a frame, checkered cell backgrounds
+// centered on the gems and grid lines between them, all in world space
+class BoardBackground : public Geometry
+{
+	unsigned int vbo;
+	std::vector<float> vertices;	// x, y, r, g, b, heart beat per vertex
+
+	void AddRect(float x0, float y0, float x1, float y1, vec4 color)
+	{
+		float corners[6][2] = { { x0, y0 }, { x1, y0 }, { x1, y1 }, { x0, y0 }, { x1, y1 }, { x0, y1 } };
+		for (int v = 0; v < 6; v++)
+		{
+			vertices.push_back(corners[v][0]);
+			vertices.push_back(corners[v][1]);
+			vertices.push_back(color.v[0]);
+			vertices.push_back(color.v[1]);
+			vertices.push_back(color.v[2]);
+			vertices.push_back(0);
+		}
+	}
+
+public:
+	// origin is the corner of cell (0, 0), center the gem center within a cell
+	BoardBackground(int width, int height, vec2 origin, float cellSize, float center)
+	{
+		float x0 = origin.x + center - cellSize / 2, y0 = origin.y + center - cellSize / 2;
+		float x1 = x0 + width * cellSize, y1 = y0 + height * cellSize;
+		float frame = cellSize * 0.1, line = cellSize * 0.02;
+
+		vec4 frameColor(0.35, 0.3, 0.2), lineColor(0.25, 0.25, 0.3);
+		AddRect(x0 - frame, y0 - frame, x1 + frame, y1 + frame, frameColor);
+		// past 256x256 cells the checkers and lines are below a pixel anyway
+		if (width * height > 65536)
+		{
+			AddRect(x0, y0, x1, y1, vec4(0.14, 0.14, 0.18));
+			width = height = 0;
+		}
+		for (int i = 0; i < width; i++)
+			for (int j = 0; j < height; j++)
+				AddRect(x0 + i * cellSize, y0 + j * cellSize, x0 + (i + 1) * cellSize, y0 + (j + 1) * cellSize,
+					(i + j) % 2 ? vec4(0.12, 0.12, 0.16) : vec4(0.16, 0.16, 0.21));
+		for (int i = 1; i < width; i++)
+			AddRect(x0 + i * cellSize - line / 2, y0, x0 + i * cellSize + line / 2, y1, lineColor);
+		for (int j = 1; j < height; j++)
+			AddRect(x0, y0 + j * cellSize - line / 2, x1, y0 + j * cellSize + line / 2, lineColor);
+
+		glBindVertexArray(vao);
+		glGenBuffers(1, &vbo);
+		glBindBuffer(GL_ARRAY_BUFFER, vbo);
+		glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(float), &vertices[0], GL_STATIC_DRAW);
+
+		glEnableVertexAttribArray(0);	// position
+		glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 6 * sizeof(float), NULL);
+		glEnableVertexAttribArray(1);	// color and heart beat flag
+		glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)(2 * sizeof(float)));
+	}
+
+	~BoardBackground()
+	{
+		glDeleteBuffers(1, &vbo);
+	}
+
+	void Draw()
+	{
+		glBindVertexArray(vao);
+		glDrawArrays(GL_TRIANGLES, 0, vertices.size() / 6);
+	}
+};
+
+// static layers are rendered in order into an offscreen framebuffer once and
+// then only blitted every frame. The cache is redrawn after the camera moved
+// (its revision changed) or the window was resized.
+class Compositor
+{
+	Shader* shader;
+	std::vector<Mesh*> staticLayers;
+	unsigned int fbo, texture;
+	int width, height;
+	unsigned int cameraRevision;
+	bool valid;
+
+public:
+	Compositor(Shader* shader, int width, int height) : shader(shader), width(0), height(0), cameraRevision(0), valid(false)
+	{
+		glGenFramebuffers(1, &fbo);
+		glGenTextures(1, &texture);
+		Resize(width, height);
+	}
+
+	~Compositor()
+	{
+		glDeleteFramebuffers(1, &fbo);
+		glDeleteTextures(1, &texture);
+	}
+
+	void AddStaticLayer(Mesh* layer)
+	{
+		staticLayers.push_back(layer);
+		valid = false;
+	}
+
+	void Resize(int width, int height)
+	{
+		if (width == this->width && height == this->height) return;
+		this->width = width;
+		this->height = height;
+
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+		glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) printf("static layer framebuffer is incomplete\n");
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		valid = false;
+	}
+
+	void Invalidate()
+	{
+		valid = false;
+	}
+
+	// redraws the cache if needed, then copies it to the screen
+	void DrawStatic()
+	{
+		if (!valid || cameraRevision != camera.getRevision())
+		{
+			glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+			glClearColor(0, 0, 0, 0);
+			glClear(GL_COLOR_BUFFER_BIT);
+			shader->Run();
+			mat4 V = camera.GetViewTransformationMatrix();
+			shader->UploadM(V);
+			for (int k = 0; k < staticLayers.size(); k++) staticLayers[k]->Draw();
+			glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+			cameraRevision = camera.getRevision();
+			valid = true;
+		}
+
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+		glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	}
+};
+
+// board size and the mapping between cells and world coordinates; the board is
+// centered and its longer side spans [-1, 1], cell (i, j) is column i, row j
+struct BoardLayout
+{
+	int width, height;
+	int gemTypes;		// object IDs 1..gemTypes
+	float cellSize;
+	vec2 origin;		// world position of the corner of cell (0, 0)
+
+	BoardLayout(int width, int height, int gemTypes) : width(width), height(height), gemTypes(gemTypes)
+	{
+		cellSize = 2.0f / (width > height ? width : height);
+		origin = vec2(-width * cellSize / 2, -height * cellSize / 2);
+	}
+
+	int Index(int i, int j) {
+		return i * height + j;
+	}
+
+	// gems sit off the cell center by the same fraction as on the original 10x10 board
+	float GemOffset() {
+		return cellSize * 0.4f;
+	}
+
+	float GemScale() {
+		return cellSize * 0.5f;
+	}
+
+	vec2 CellPosition(int i, int j) {
+		return vec2(origin.x + i * cellSize + GemOffset(), origin.y + j * cellSize + GemOffset());
+	}
+
+	int Column(float x) {
+		return (int)floor((x - origin.x) / cellSize);
+	}
+
+	int Row(float y) {
+		return (int)floor((y - origin.y) / cellSize);
+	}
+};
+
+// bit scans, with the 64-bit intrinsics split in two on 32-bit targets
+#if defined(_MSC_VER)
+#include <intrin.h>
+inline int popCount64(unsigned long long x) {
+#if defined(_M_X64)
+	return (int)__popcnt64(x);
+#else
+	return (int)(__popcnt((unsigned int)x) + __popcnt((unsigned int)(x >> 32)));
+#endif
+}
+inline int countTrailingZeros64(unsigned long long x) {
+	unsigned long k;
+#if defined(_M_X64)
+	_BitScanForward64(&k, x);
+#else
+	if (_BitScanForward(&k, (unsigned long)x)) return (int)k;
+	_BitScanForward(&k, (unsigned long)(x >> 32));
+	k += 32;
+#endif
+	return (int)k;
+}
+#else
+inline int popCount64(unsigned long long x) { return __builtin_popcountll(x); }
+inline int countTrailingZeros64(unsigned long long x) { return __builtin_ctzll(x); }
+#endif
+
+// bitboard operations are tiny and must inline for constant shifts to fold
+#if defined(_MSC_VER)
+#define BITS_INLINE __forceinline
+#else
+#define BITS_INLINE inline __attribute__((always_inline))
+#endif
+
+// xoshiro256** by Blackman and Vigna, seeded through splitmix64. Small and
+// fast, and a run is reproducible from its seed. Split hands out streams that
+// do not overlap for the next 2^128 numbers, one per board or worker.
+class Random
+{
+	unsigned long long s[4];
+
+	static unsigned long long Rotl(unsigned long long x, int k) {
+		return (x << k) | (x >> (64 - k));
+	}
+
+public:
+	Random(unsigned long long seed = 0) {
+		Seed(seed);
+	}
+
+	void Seed(unsigned long long seed) {
+		for (int k = 0; k < 4; k++)
+		{
+			unsigned long long z = (seed += 0x9e3779b97f4a7c15ull);
+			z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+			z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+			s[k] = z ^ (z >> 31);
+		}
+	}
+
+	unsigned long long Next() {
+		unsigned long long result = Rotl(s[1] * 5, 7) * 9;
+		unsigned long long t = s[1] << 17;
+		s[2] ^= s[0];
+		s[3] ^= s[1];
+		s[1] ^= s[2];
+		s[0] ^= s[3];
+		s[2] ^= t;
+		s[3] = Rotl(s[3], 45);
+		return result;
+	}
+
+	// an integer in [0, n) by Lemire's multiply and shift, unbiased
+	unsigned int Below(unsigned int n) {
+		unsigned long long m = (Next() >> 32) * n;
+		if ((unsigned int)m < n)
+		{
+			unsigned int threshold = (0u - n) % n;
+			while ((unsigned int)m < threshold) m = (Next() >> 32) * n;
+		}
+		return (unsigned int)(m >> 32);
+	}
+
+	// fills count bytes with first + [0, n), two draws per 64-bit number. Each half
+	// is rejected like in Below and replaced by a Below draw, so it is unbiased too.
+	void Fill(unsigned char* out, int count, unsigned int n, unsigned char first) {
+		unsigned int threshold = (0u - n) % n;
+		int k = 0;
+		for (; k + 1 < count; k += 2)
+		{
+			unsigned long long r = Next();
+			unsigned long long high = (r >> 32) * n, low = (r & 0xffffffffull) * n;
+			out[k] = (unsigned char)(first + ((unsigned int)high < threshold ? Below(n) : (unsigned int)(high >> 32)));
+			out[k + 1] = (unsigned char)(first + ((unsigned int)low < threshold ? Below(n) : (unsigned int)(low >> 32)));
+		}
+		if (k < count) out[k] = (unsigned char)(first + Below(n));
+	}
+
+	// advances the stream by 2^128 numbers
+	void Jump() {
+		static const unsigned long long jump[4] = { 0x180ec6d33cfd0abaull, 0xd5a61266f0c9392cull, 0xa9582618e03fc9aaull, 0x39abdc4529b1661cull };
+		unsigned long long t[4] = { 0, 0, 0, 0 };
+		for (int w = 0; w < 4; w++)
+			for (int b = 0; b < 64; b++)
+			{
+				if (jump[w] & (1ull << b))
+					for (int k = 0; k < 4; k++) t[k] ^= s[k];
+				Next();
+			}
+		for (int k = 0; k < 4; k++) s[k] = t[k];
+	}
+
+	// the four state words, for writing a stream out to go on with it later
+	void getState(unsigned long long state[4]) const {
+		for (int k = 0; k < 4; k++) state[k] = s[k];
+	}
+
+	void setState(const unsigned long long state[4]) {
+		for (int k = 0; k < 4; k++) s[k] = state[k];
+	}
+
+	// a stream of its own: the current one, while this one jumps past it
+	Random Split() {
+		Random stream = *this;
+		Jump();
+		return stream;
+	}
+};
+
+// the most gem types a board core can hold, object IDs 1..maxGemTypes
+const int maxGemTypes = gemShapeCount - 1;
+
+// the Zobrist key of a gem of color c (0-based) in cell bit, a splitmix64 hash
+// rather than a table lookup so boards of any size can be hashed. c goes up to
+// 15, keys past maxGemTypes are free for things other than gems.
+inline unsigned long long zobristKey(int c, int bit) {
+	unsigned long long z = (((unsigned long long)bit << 4) + c + 1) * 0x9e3779b97f4a7c15ull;
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+	return z ^ (z >> 31);
+}
+
+// the count and the r-th set bit of every mask of gem IDs, so picking one of the
+// allowed colors takes two lookups instead of a loop with an unpredictable trip count
+struct NthBitTable
+{
+	unsigned char count[1 << (maxGemTypes + 1)];
+	unsigned char bit[1 << (maxGemTypes + 1)][maxGemTypes];
+};
+
+constexpr NthBitTable makeNthBitTable()
+{
+	NthBitTable table = {};
+	for (int mask = 0; mask < (1 << (maxGemTypes + 1)); mask++)
+	{
+		int r = 0;
+		for (int b = 1; b <= maxGemTypes; b++)	// bit 0 is no gem
+			if (mask & (1 << b)) table.bit[mask][r++] = (unsigned char)b;
+		table.count[mask] = (unsigned char)r;
+	}
+	return table;
+}
+
+constexpr NthBitTable nthBit = makeNthBitTable();
+
+// dropping the gems of one column to its bottom: every plane of the column keeps
+// only its occupied bits, packed down in order. BMI2's pext does a plane in one
+// instruction, other CPUs walk the occupied bits.
+void collapseColumnPortable(unsigned long long* column, int colors, unsigned long long occupied)
+{
+	unsigned long long packed[maxGemTypes] = { 0 };
+	int n = 0;
+	for (unsigned long long rest = occupied; rest; rest &= rest - 1, n++)
+	{
+		int b = countTrailingZeros64(rest);
+		for (int c = 0; c < colors; c++) packed[c] |= ((column[c] >> b) & 1) << n;
+	}
+	for (int c = 0; c < colors; c++) column[c] = packed[c];
+}
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#if defined(_MSC_VER)
+void collapseColumnBmi2(unsigned long long* column, int colors, unsigned long long occupied)
+#else
+__attribute__((target("bmi2"))) void collapseColumnBmi2(unsigned long long* column, int colors, unsigned long long occupied)
+#endif
+{
+	for (int c = 0; c < colors; c++) column[c] = _pext_u64(column[c], occupied);
+}
+
+bool cpuHasBmi2()
+{
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 8)) != 0;
+#else
+	return __builtin_cpu_supports("bmi2");
+#endif
+}
+
+void(*const collapseColumn)(unsigned long long*, int, unsigned long long) =
+	cpuHasBmi2() ? collapseColumnBmi2 : collapseColumnPortable;
+#else
+void(*const collapseColumn)(unsigned long long*, int, unsigned long long) = collapseColumnPortable;
+#endif
+
+// word-wise operations on several 64-bit lanes at once, one struct per
+// instruction set; see BoardLanes. GCC gets vector extensions, which take the
+// instruction set of the function they are inlined into, MSVC intrinsics.
+// Shift counts are template arguments so intrinsics get immediates; 64 and
+// more shift everything out.
+enum LaneSet { LANES_SCALAR = 0, LANES_SSE2, LANES_AVX2, LANES_AVX512, LANE_SET_COUNT };
+
+const char* laneSetNames[LANE_SET_COUNT] = { "scalar", "sse2", "avx2", "avx512" };
+
+struct ScalarLanes
+{
+	typedef unsigned long long V;
+	static const int width = 1;
+	static BITS_INLINE V Load(const unsigned long long* p) { return *p; }
+	static BITS_INLINE void Store(unsigned long long* p, V v) { *p = v; }
+	static BITS_INLINE V Broadcast(unsigned long long x) { return x; }
+	static BITS_INLINE V Zero() { return 0; }
+	static BITS_INLINE V And(V a, V b) { return a & b; }
+	static BITS_INLINE V Or(V a, V b) { return a | b; }
+	static BITS_INLINE V AndNot(V a, V b) { return a & ~b; }
+	template<int S> static BITS_INLINE V Left(V v) { return S >= 64 ? 0 : v << (S & 63); }
+	template<int S> static BITS_INLINE V Right(V v) { return S >= 64 ? 0 : v >> (S & 63); }
+};
+
+#if defined(__x86_64__) || defined(_M_X64)
+#if defined(_MSC_VER)
+#define TARGET_SSE2
+#define TARGET_AVX2
+#define TARGET_AVX512
+
+struct Sse2Lanes
+{
+	typedef __m128i V;
+	static const int width = 2;
+	static BITS_INLINE V Load(const unsigned long long* p) { return _mm_loadu_si128((const __m128i*)p); }
+	static BITS_INLINE void Store(unsigned long long* p, V v) { _mm_storeu_si128((__m128i*)p, v); }
+	static BITS_INLINE V Broadcast(unsigned long long x) { return _mm_set1_epi64x((long long)x); }
+	static BITS_INLINE V Zero() { return _mm_setzero_si128(); }
+	static BITS_INLINE V And(V a, V b) { return _mm_and_si128(a, b); }
+	static BITS_INLINE V Or(V a, V b) { return _mm_or_si128(a, b); }
+	static BITS_INLINE V AndNot(V a, V b) { return _mm_andnot_si128(b, a); }
+	template<int S> static BITS_INLINE V Left(V v) { return S >= 64 ? Zero() : _mm_slli_epi64(v, S & 63); }
+	template<int S> static BITS_INLINE V Right(V v) { return S >= 64 ? Zero() : _mm_srli_epi64(v, S & 63); }
+};
+
+struct Avx2Lanes
+{
+	typedef __m256i V;
+	static const int width = 4;
+	static BITS_INLINE V Load(const unsigned long long* p) { return _mm256_loadu_si256((const __m256i*)p); }
+	static BITS_INLINE void Store(unsigned long long* p, V v) { _mm256_storeu_si256((__m256i*)p, v); }
+	static BITS_INLINE V Broadcast(unsigned long long x) { return _mm256_set1_epi64x((long long)x); }
+	static BITS_INLINE V Zero() { return _mm256_setzero_si256(); }
+	static BITS_INLINE V And(V a, V b) { return _mm256_and_si256(a, b); }
+	static BITS_INLINE V Or(V a, V b) { return _mm256_or_si256(a, b); }
+	static BITS_INLINE V AndNot(V a, V b) { return _mm256_andnot_si256(b, a); }
+	template<int S> static BITS_INLINE V Left(V v) { return S >= 64 ? Zero() : _mm256_slli_epi64(v, S & 63); }
+	template<int S> static BITS_INLINE V Right(V v) { return S >= 64 ? Zero() : _mm256_srli_epi64(v, S & 63); }
+};
+
+struct Avx512Lanes
+{
+	typedef __m512i V;
+	static const int width = 8;
+	static BITS_INLINE V Load(const unsigned long long* p) { return _mm512_loadu_si512(p); }
+	static BITS_INLINE void Store(unsigned long long* p, V v) { _mm512_storeu_si512(p, v); }
+	static BITS_INLINE V Broadcast(unsigned long long x) { return _mm512_set1_epi64((long long)x); }
+	static BITS_INLINE V Zero() { return _mm512_setzero_si512(); }
+	static BITS_INLINE V And(V a, V b) { return _mm512_and_si512(a, b); }
+	static BITS_INLINE V Or(V a, V b) { return _mm512_or_si512(a, b); }
+	static BITS_INLINE V AndNot(V a, V b) { return _mm512_andnot_si512(b, a); }
+	template<int S> static BITS_INLINE V Left(V v) { return S >= 64 ? Zero() : _mm512_slli_epi64(v, S & 63); }
+	template<int S> static BITS_INLINE V Right(V v) { return S >= 64 ? Zero() : _mm512_srli_epi64(v, S & 63); }
+};
+
+LaneSet bestLaneSet()
+{
+	int info[4];
+	__cpuid(info, 1);
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	unsigned long long xcr0 = osxsave ? _xgetbv(0) : 0;
+	__cpuidex(info, 7, 0);
+	if ((info[1] & (1 << 16)) && (xcr0 & 0xe6) == 0xe6) return LANES_AVX512;
+	if ((info[1] & (1 << 5)) && (xcr0 & 6) == 6) return LANES_AVX2;
+	return LANES_SSE2;
+}
+#else
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_AVX512 __attribute__((target("avx512f")))
+
+// the vectors never cross a call, everything here is inlined into the kernels.
+// Arguments go by reference, so no vector is passed under the baseline ABI; the
+// returns are still checked, here and again at the end of the file
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpsabi"
+#endif
+template<int N>
+struct VectorLanes
+{
+	typedef unsigned long long V __attribute__((vector_size(8 * N)));
+	static const int width = N;
+	static BITS_INLINE V Load(const unsigned long long* p) { V v; memcpy(&v, p, sizeof v); return v; }
+	static BITS_INLINE void Store(unsigned long long* p, const V& v) { memcpy(p, &v, sizeof v); }
+	static BITS_INLINE V Broadcast(unsigned long long x) { return Zero() + x; }
+	static BITS_INLINE V Zero() { V v = {}; return v; }
+	static BITS_INLINE V And(const V& a, const V& b) { return a & b; }
+	static BITS_INLINE V Or(const V& a, const V& b) { return a | b; }
+	static BITS_INLINE V AndNot(const V& a, const V& b) { return a & ~b; }
+	template<int S> static BITS_INLINE V Left(const V& v) { return S >= 64 ? Zero() : v << (S & 63); }
+	template<int S> static BITS_INLINE V Right(const V& v) { return S >= 64 ? Zero() : v >> (S & 63); }
+};
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+typedef VectorLanes<2> Sse2Lanes;
+typedef VectorLanes<4> Avx2Lanes;
+typedef VectorLanes<8> Avx512Lanes;
+
+LaneSet bestLaneSet()
+{
+	if (__builtin_cpu_supports("avx512f")) return LANES_AVX512;
+	if (__builtin_cpu_supports("avx2")) return LANES_AVX2;
+	return LANES_SSE2;
+}
+#endif
+#else
+LaneSet bestLaneSet()
+{
+	return LANES_SCALAR;
+}
+#endif
+
+const LaneSet laneSet = bestLaneSet();
+
+// what a cascade did: how many times matches were cleared in a row, the gems
+// cleared in total and the score, which grows with the chain
+struct CascadeReport
+{
+	int chain, cleared, score;
+
+	CascadeReport() : chain(0), cleared(0), score(0) {}
+
+	void Add(int count) {
+		chain++;
+		cleared += count;
+		score += 10 * count * chain;
+	}
+};
+
+// one thing a resolved move did to the board, for replaying it as animation.
+// Link 0 is the move itself, link n the n-th clear of the chain.
+enum CascadeEventType
+{
+	EVENT_SWAP,		// (i, j) and (u, v) traded gems
+	EVENT_CLEAR,	// the gem of (i, j) was cleared
+	EVENT_FALL,		// the gem of (i, j) fell to (i, v)
+	EVENT_SPAWN		// a new gem ID landed in (i, j), dropped from row v above the board
+};
+
+struct CascadeEvent
+{
+	int type, link;
+	int i, j, u, v, ID;
+};
+
+// board shape as template arguments for the modes we ship, so every loop over
+// cells, words and colors has a constant trip count, or as plain values otherwise
+template<int W, int H, int C>
+struct FixedBoardSize
+{
+	FixedBoardSize(int = W, int = H, int = C) {}
+	int Width() const { return W; }
+	int Height() const { return H; }
+	int Colors() const { return C; }
+};
+
+struct RuntimeBoardSize
+{
+	int width, height, colors;
+	RuntimeBoardSize(int width, int height, int colors) : width(width), height(height), colors(colors) {}
+	int Width() const { return width; }
+	int Height() const { return height; }
+	int Colors() const { return colors; }
+};
+
+// storage for a bitboard: a word count known at compile time (one word up to
+// 64 cells, two up to 128, a register-sized array beyond) or a heap array
+template<int Words>
+struct FixedWords
+{
+	unsigned long long w[Words];
+	FixedWords(int = 0) { for (int k = 0; k < Words; k++) w[k] = 0; }
+	int WordCount() const { return Words; }
+};
+
+struct DynamicWords
+{
+	std::vector<unsigned long long> w;
+	DynamicWords(int bits = 0) : w((bits + 63) / 64, 0) {}
+	int WordCount() const { return (int)w.size(); }
+};
+
+// a set of cells, bit i * height + j is cell (i, j), so a column is a run of
+// bits and the cell above is the next bit. Bits past the last cell stay zero.
+template<class Storage>
+struct Bits : public Storage
+{
+	Bits(int bits = 0) : Storage(bits) {}
+
+	BITS_INLINE bool Test(int bit) const { return (this->w[bit >> 6] >> (bit & 63)) & 1; }
+	BITS_INLINE void Set(int bit) { this->w[bit >> 6] |= 1ull << (bit & 63); }
+	BITS_INLINE void Reset(int bit) { this->w[bit >> 6] &= ~(1ull << (bit & 63)); }
+
+	BITS_INLINE Bits& operator&=(const Bits& b) { for (int k = 0; k < this->WordCount(); k++) this->w[k] &= b.w[k]; return *this; }
+	BITS_INLINE Bits& operator|=(const Bits& b) { for (int k = 0; k < this->WordCount(); k++) this->w[k] |= b.w[k]; return *this; }
+	BITS_INLINE Bits operator&(const Bits& b) const { Bits r(*this); r &= b; return r; }
+	BITS_INLINE Bits operator|(const Bits& b) const { Bits r(*this); r |= b; return r; }
+	BITS_INLINE Bits AndNot(const Bits& b) const {
+		Bits r(*this);
+		for (int k = 0; k < this->WordCount(); k++) r.w[k] &= ~b.w[k];
+		return r;
+	}
+
+	// word k of the bits moved down by s, bit k to k - s
+	BITS_INLINE unsigned long long DownWord(int k, int s) const {
+		int n = this->WordCount(), q = s >> 6, m = s & 63;
+		unsigned long long lo = k + q < n ? this->w[k + q] : 0;
+		unsigned long long hi = k + q + 1 < n ? this->w[k + q + 1] : 0;
+		return m ? (lo >> m) | (hi << (64 - m)) : lo;
+	}
+
+	// word k of the bits moved up by s, bit k to k + s
+	BITS_INLINE unsigned long long UpWord(int k, int s) const {
+		int q = s >> 6, m = s & 63;
+		unsigned long long hi = k - q >= 0 ? this->w[k - q] : 0;
+		unsigned long long lo = k - q - 1 >= 0 ? this->w[k - q - 1] : 0;
+		return m ? (hi << m) | (lo >> (64 - m)) : hi;
+	}
+
+	BITS_INLINE Bits Down(int s) const {
+		Bits r(*this);
+		for (int k = 0; k < this->WordCount(); k++) r.w[k] = DownWord(k, s);
+		return r;
+	}
+
+	// the caller keeps the result inside the board
+	BITS_INLINE Bits Up(int s) const {
+		Bits r(*this);
+		for (int k = 0; k < this->WordCount(); k++) r.w[k] = UpWord(k, s);
+		return r;
+	}
+
+	BITS_INLINE bool Any() const {
+		unsigned long long any = 0;
+		for (int k = 0; k < this->WordCount(); k++) any |= this->w[k];
+		return any != 0;
+	}
+
+	BITS_INLINE int Count() const {
+		int count = 0;
+		for (int k = 0; k < this->WordCount(); k++) count += popCount64(this->w[k]);
+		return count;
+	}
+
+	// count <= 64 bits starting at bit offset, as the low bits of a word. The bits
+	// never run past the last word; the check says so to the compiler, and costs
+	// nothing on fixed sizes.
+	BITS_INLINE unsigned long long Extract(int offset, int count) const {
+		int q = offset >> 6, m = offset & 63;
+		unsigned long long bits = this->w[q] >> m;
+		if (m + count > 64 && q + 1 < this->WordCount()) bits |= this->w[q + 1] << (64 - m);
+		return count == 64 ? bits : bits & ((1ull << count) - 1);
+	}
+
+	BITS_INLINE void Insert(int offset, int count, unsigned long long bits) {
+		int q = offset >> 6, m = offset & 63;
+		unsigned long long mask = count == 64 ? ~0ull : (1ull << count) - 1;
+		this->w[q] = (this->w[q] & ~(mask << m)) | (bits << m);
+		if (m + count > 64 && q + 1 < this->WordCount())
+			this->w[q + 1] = (this->w[q + 1] & ~(mask >> (64 - m))) | (bits >> (64 - m));
+	}
+
+	// the index of the lowest set bit, -1 if there is none
+	BITS_INLINE int First() const {
+		for (int k = 0; k < this->WordCount(); k++)
+			if (this->w[k]) return k * 64 + countTrailingZeros64(this->w[k]);
+		return -1;
+	}
+
+	// the index of the n-th set bit, counting from 0; -1 if there are fewer
+	int NthSet(int n) const {
+		for (int k = 0; k < this->WordCount(); k++)
+		{
+			unsigned long long word = this->w[k];
+			int count = popCount64(word);
+			if (n >= count)
+			{
+				n -= count;
+				continue;
+			}
+			for (; n > 0; n--) word &= word - 1;
+			return k * 64 + countTrailingZeros64(word);
+		}
+		return -1;
+	}
+
+	template<class F>
+	void ForEach(F f) const {
+		for (int k = 0; k < this->WordCount(); k++)
+			for (unsigned long long word = this->w[k]; word; word &= word - 1)
+				f(k * 64 + countTrailingZeros64(word));
+	}
+};
+
+template<int Words>
+using BitBoard = Bits<FixedWords<Words> >;
+typedef Bits<DynamicWords> DynamicBitBoard;
+
+// the game board as one bitboard per gem type. Size and Bits decide whether the
+// shape is fixed at compile time; the algorithms are the same for both.
+template<class Size, class BitSet>
+class BoardCore
+{
+public:
+	typedef BitSet BitsType;
+
+private:
+	Size size;
+	BitSet planes[maxGemTypes];
+	// row masks that keep vertical shifts inside a column, and neighbor masks
+	BitSet cells;			// every cell of the board
+	BitSet runStarts;		// cells with at least two more cells above them in their column
+	BitSet runEnds;			// cells with at least two more cells below them
+	BitSet runMiddles;		// cells with a cell above and below them
+	BitSet hasRight;		// cells with a right neighbor
+	BitSet hasUp;			// cells with a neighbor above
+
+	int Bit(int i, int j) const { return i * size.Height() + j; }
+
+	Random random;			// for Generate and Shuffle
+
+	// the legal move index, see RefreshMoves
+	BitSet moveRight, moveUp;
+	BitSet stale;			// cells changed since the index was refreshed
+	int staleCount, moveCount;
+
+	unsigned long long hash;	// the xor of zobristKey over every gem, kept up to date by every change
+
+	// the bits (i - 2 .. i + 2) or (j - 2 .. j + 2) of a plane, zero off the board
+	int Window(const BitSet& plane, int i, int j, int di, int dj) const {
+		int window = 0;
+		for (int k = -2; k <= 2; k++)
+		{
+			int u = i + k * di, v = j + k * dj;
+			bool inside = u >= 0 && u < size.Width() && v >= 0 && v < size.Height();
+			window |= (inside && plane.Test(Bit(u, v))) << (k + 2);
+		}
+		return window;
+	}
+
+	// a run of three through the center of the window
+	static bool HasRun(int window) {
+		return (window & (window >> 1) & (window >> 2) & 7) != 0;
+	}
+
+	// would gem ID moved into (i, j) from its neighbor (u, v) be part of a run
+	bool RunsThrough(int ID, int i, int j, int u, int v) const {
+		if (ID == 0) return false;
+		// the center holds the gem now, the neighbor holds a gem of another color
+		int partner = 1 << (2 + (u - i) + (v - j));
+		int horizontal = (Window(planes[ID - 1], i, j, 1, 0) | 4) & (v == j ? ~partner : ~0);
+		int vertical = (Window(planes[ID - 1], i, j, 0, 1) | 4) & (u == i ? ~partner : ~0);
+		return HasRun(horizontal) | HasRun(vertical);
+	}
+
+	void UpdateMove(BitSet& moves, int bit, bool legal) {
+		if (moves.Test(bit) == legal) return;
+		if (legal) moves.Set(bit); else moves.Reset(bit);
+		moveCount += legal ? 1 : -1;
+	}
+
+public:
+	BoardCore(Size size = Size()) : size(size), cells(Cells()), runStarts(Cells()), runEnds(Cells()),
+		runMiddles(Cells()), hasRight(Cells()), hasUp(Cells()), moveRight(Cells()), moveUp(Cells()),
+		stale(Cells()), staleCount(0), moveCount(0), hash(0) {
+		for (int c = 0; c < maxGemTypes; c++) planes[c] = BitSet(Cells());
+		for (int i = 0; i < Width(); i++)
+			for (int j = 0; j < Height(); j++)
+			{
+				int bit = Bit(i, j);
+				cells.Set(bit);
+				if (j + 2 < Height()) runStarts.Set(bit);
+				if (j >= 2) runEnds.Set(bit);
+				if (j >= 1 && j + 1 < Height()) runMiddles.Set(bit);
+				if (i + 1 < Width()) hasRight.Set(bit);
+				if (j + 1 < Height()) hasUp.Set(bit);
+			}
+		stale = cells;
+		staleCount = Cells();
+	}
+
+	int Width() const { return size.Width(); }
+	int Height() const { return size.Height(); }
+	int Colors() const { return size.Colors(); }
+	int Cells() const { return size.Width() * size.Height(); }
+
+	unsigned long long Hash() const { return hash; }
+
+	// a key shared by every board equal to this one up to the left-right mirror
+	// and a renaming of the colors; gravity rules out the vertical flip. Colors are
+	// renamed in the order they first show up in bit order, and of the board and
+	// its mirror image the one with the smaller key stands. mirrored tells which.
+	unsigned long long CanonicalKey(bool& mirrored) const {
+		const int W = Width(), H = Height();
+		BitSet flipped[maxGemTypes];
+		for (int c = 0; c < Colors(); c++)
+		{
+			flipped[c] = BitSet(Cells());
+			for (int i = 0; i < W; i++)
+				for (int j = 0; j < H; j += 64)
+				{
+					int count = H - j < 64 ? H - j : 64;
+					flipped[c].Insert(Bit(W - 1 - i, j), count, planes[c].Extract(Bit(i, j), count));
+				}
+		}
+		unsigned long long straight = RelabeledKey(planes), mirror = RelabeledKey(flipped);
+		mirrored = mirror < straight;
+		return mirrored ? mirror : straight;
+	}
+
+	// ID 0 leaves the cell empty
+	void Set(int i, int j, int ID) {
+		int bit = Bit(i, j), old = Get(i, j);
+		if (old > 0) hash ^= zobristKey(old - 1, bit);
+		if (ID > 0) hash ^= zobristKey(ID - 1, bit);
+		for (int c = 0; c < Colors(); c++) planes[c].Reset(bit);
+		if (ID > 0) planes[ID - 1].Set(bit);
+		MarkStale(bit);
+	}
+
+	int Get(int i, int j) const {
+		int bit = Bit(i, j), ID = 0;
+		for (int c = 0; c < Colors(); c++) ID |= planes[c].Test(bit) * (c + 1);
+		return ID;
+	}
+
+	const BitSet& Plane(int ID) const {
+		return planes[ID - 1];
+	}
+
+	void Swap(int i, int j, int u, int v) {
+		int a = Get(i, j);
+		Set(i, j, Get(u, v));
+		Set(u, v, a);
+	}
+
+	// every cell in a horizontal or vertical run of three or more, word by word
+	// so large boards need no temporary board per shift
+	BitSet Matches() const {
+		const int H = Height(), n = cells.WordCount();
+		BitSet matches(Cells()), h(Cells()), v(Cells());	// h and v: cells starting a run
+		for (int c = 0; c < Colors(); c++)
+		{
+			const BitSet& b = planes[c];
+			for (int k = 0; k < n; k++)
+			{
+				h.w[k] = b.w[k] & b.DownWord(k, H) & b.DownWord(k, 2 * H);
+				v.w[k] = b.w[k] & b.DownWord(k, 1) & b.DownWord(k, 2) & runStarts.w[k];
+			}
+			for (int k = 0; k < n; k++)
+				matches.w[k] |= h.w[k] | h.UpWord(k, H) | h.UpWord(k, 2 * H) | v.w[k] | v.UpWord(k, 1) | v.UpWord(k, 2);
+		}
+		return matches;
+	}
+
+	// neighbors whose swap makes a run through either of them
+	bool IsLegalSwap(int i, int j, int u, int v) const {
+		if (abs(i - u) + abs(j - v) != 1) return false;
+		int a = Get(i, j), b = Get(u, v);
+		return a != b && (RunsThrough(b, i, j, u, v) | RunsThrough(a, u, v, i, j));
+	}
+
+	// every legal swap at once: bit (i, j) of right is the swap of (i, j) with
+	// (i + 1, j), of up the swap with (i, j + 1). A gem moved into a cell matches
+	// if two gems of its color line up with that cell on a side it did not come from.
+	void LegalMoves(BitSet& right, BitSet& up) const {
+		const int H = Height();
+		right = BitSet(Cells());
+		up = BitSet(Cells());
+		BitSet sameRight(Cells()), sameUp(Cells());
+		for (int c = 0; c < Colors(); c++)
+		{
+			const BitSet& b = planes[c];
+			BitSet left2 = b.Up(H) & b.Up(2 * H) & cells;
+			BitSet right2 = b.Down(H) & b.Down(2 * H);
+			BitSet sides = b.Up(H) & b.Down(H) & cells;
+			BitSet below2 = b.Up(1) & b.Up(2) & runEnds;
+			BitSet above2 = b.Down(1) & b.Down(2) & runStarts;
+			BitSet around = b.Up(1) & b.Down(1) & runMiddles;
+
+			// c moved left into a cell, or moved right into the cell to the right
+			BitSet vertical = below2 | above2 | around;
+			right |= (b.Down(H) & (left2 | vertical)) | (b & (right2 | vertical).Down(H));
+			// c moved down into a cell, or moved up into the cell above
+			BitSet horizontal = left2 | right2 | sides;
+			up |= (b.Down(1) & (horizontal | below2)) | (b & (horizontal | above2).Down(1));
+
+			sameRight |= b & b.Down(H);
+			sameUp |= b & b.Down(1);
+		}
+		right = (right & hasRight).AndNot(sameRight);
+		up = (up & hasUp).AndNot(sameUp);
+	}
+
+	// the cascade engine, one discrete phase per call: clear, collapse, refill
+
+	// the cells become empty
+	void Clear(const BitSet& cleared) {
+		for (int c = 0; c < Colors(); c++)
+		{
+			(planes[c] & cleared).ForEach([&](int bit) { hash ^= zobristKey(c, bit); });
+			planes[c] = planes[c].AndNot(cleared);
+		}
+		MarkStale(cleared);
+	}
+
+	// gems fall to the bottom of their column, empty cells end up on top. Columns
+	// are packed a word at a time; the packed gems never pass unread bits.
+	void Collapse() {
+		const int H = Height();
+		unsigned long long chunk[maxGemTypes];
+		for (int i = 0; i < Width(); i++)
+		{
+			int kept = 0, lowest = -1;	// gems packed so far, the lowest cell that changed
+			for (int j = 0; j < H; j += 64)
+			{
+				int count = H - j < 64 ? H - j : 64;
+				unsigned long long occupied = 0;
+				for (int c = 0; c < Colors(); c++) occupied |= chunk[c] = planes[c].Extract(Bit(i, j), count);
+				int n = popCount64(occupied);
+				if (lowest < 0)
+				{
+					if (n == count)
+					{
+						kept += n;
+						continue;
+					}
+					lowest = j + countTrailingZeros64(~occupied);
+					hash ^= ColumnHash(i, lowest);
+				}
+				if (n == 0) continue;
+				collapseColumn(chunk, Colors(), occupied);
+				for (int c = 0; c < Colors(); c++) planes[c].Insert(Bit(i, kept), n, chunk[c]);
+				kept += n;
+			}
+			if (lowest < 0) continue;
+			for (int j = kept; j < H; j += 64)
+			{
+				int count = H - j < 64 ? H - j : 64;
+				for (int c = 0; c < Colors(); c++) planes[c].Insert(Bit(i, j), count, 0);
+			}
+			hash ^= ColumnHash(i, lowest);
+			for (int j = lowest; j < H; j++) MarkStale(Bit(i, j));
+		}
+	}
+
+	// fills every empty cell with a random gem, the number of gems dealt
+	int Refill() {
+		BitSet empty = cells;
+		for (int c = 0; c < Colors(); c++) empty = empty.AndNot(planes[c]);
+		int count = empty.Count();
+		if (count == 0) return 0;
+		unsigned char local[1024];
+		std::vector<unsigned char> heap;
+		unsigned char* ids = count <= 1024 ? local : (heap.resize(count), &heap[0]);
+		random.Fill(ids, count, Colors(), 1);
+		int n = 0;
+		empty.ForEach([&](int bit) {
+			int c = ids[n++] - 1;
+			planes[c].Set(bit);
+			hash ^= zobristKey(c, bit);
+		});
+		MarkStale(empty);
+		return count;
+	}
+
+	// clears, collapses and refills until no match is left. Events are only
+	// recorded if asked for, logic-only callers pay for the bitboards alone.
+	CascadeReport Resolve(std::vector<CascadeEvent>* events = 0, int link = 0) {
+		CascadeReport report;
+		for (BitSet matches = Matches(); matches.Any(); matches = Matches())
+		{
+			report.Add(matches.Count());
+			ClearAndFill(matches, events, ++link);
+		}
+		return report;
+	}
+
+	// swaps two gems and resolves the cascade; nothing happens if the swap is not legal
+	CascadeReport Play(int i, int j, int u, int v, std::vector<CascadeEvent>* events = 0) {
+		if (!IsLegalSwap(i, j, u, v)) return CascadeReport();
+		Swap(i, j, u, v);
+		if (events) events->push_back(CascadeEvent{ EVENT_SWAP, 0, i, j, u, v, 0 });
+		return Resolve(events);
+	}
+
+	// clears cells that did not match, as link 0, and resolves what follows
+	CascadeReport ClearAndResolve(const BitSet& cleared, std::vector<CascadeEvent>* events = 0) {
+		if (!cleared.Any()) return CascadeReport();
+		ClearAndFill(cleared, events, 0);
+		return Resolve(events);
+	}
+
+private:
+	// one link of a cascade, with its events: the clears, then every gem that
+	// falls, then the new gems in the order they stack up in their column
+	void ClearAndFill(const BitSet& cleared, std::vector<CascadeEvent>* events, int link) {
+		const int H = Height();
+		if (events) cleared.ForEach([&](int bit) {
+			events->push_back(CascadeEvent{ EVENT_CLEAR, link, bit / H, bit % H, bit / H, bit % H, 0 });
+		});
+		Clear(cleared);
+		if (events)
+		{
+			BitSet occupied(Cells());
+			for (int c = 0; c < Colors(); c++) occupied |= planes[c];
+			for (int i = 0; i < Width(); i++)
+				for (int j = 0, kept = 0; j < H; j++)
+				{
+					if (!occupied.Test(Bit(i, j))) continue;
+					if (j != kept) events->push_back(CascadeEvent{ EVENT_FALL, link, i, j, i, kept, 0 });
+					kept++;
+				}
+		}
+		Collapse();
+		BitSet empty = cells;
+		if (events)
+			for (int c = 0; c < Colors(); c++) empty = empty.AndNot(planes[c]);
+		Refill();
+		if (events)
+		{
+			// the empty cells of a column are its top ones, new gems drop in order
+			int column = -1, first = 0;
+			empty.ForEach([&](int bit) {
+				if (bit / H != column)
+				{
+					column = bit / H;
+					first = bit % H;
+				}
+				events->push_back(CascadeEvent{ EVENT_SPAWN, link, bit / H, bit % H, bit / H, H + bit % H - first,
+					Get(bit / H, bit % H) });
+			});
+		}
+	}
+
+	// a hash of the planes with the colors in the order of their lowest bit
+	unsigned long long RelabeledKey(const BitSet* planes) const {
+		int order[maxGemTypes], first[maxGemTypes];
+		for (int c = 0; c < Colors(); c++)
+		{
+			first[c] = Cells();	// an empty plane goes last
+			for (int k = 0; k < planes[c].WordCount(); k++)
+				if (planes[c].w[k])
+				{
+					first[c] = k * 64 + countTrailingZeros64(planes[c].w[k]);
+					break;
+				}
+			int n = c;
+			for (; n > 0 && first[order[n - 1]] > first[c]; n--) order[n] = order[n - 1];
+			order[n] = c;
+		}
+		unsigned long long h = 0;
+		for (int n = 0; n < Colors(); n++)
+			for (int k = 0; k < planes[order[n]].WordCount(); k++)
+			{
+				unsigned long long z = (h ^ planes[order[n]].w[k]) + 0x9e3779b97f4a7c15ull;
+				z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+				z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+				h = z ^ (z >> 31);
+			}
+		return h;
+	}
+
+	// the Zobrist keys of the gems in cells from .. Height() - 1 of column i
+	unsigned long long ColumnHash(int i, int from) const {
+		unsigned long long h = 0;
+		for (int j = from; j < Height(); j += 64)
+		{
+			int count = Height() - j < 64 ? Height() - j : 64;
+			for (int c = 0; c < Colors(); c++)
+				for (unsigned long long bits = planes[c].Extract(Bit(i, j), count); bits; bits &= bits - 1)
+					h ^= zobristKey(c, Bit(i, j) + countTrailingZeros64(bits));
+		}
+		return h;
+	}
+
+	void MarkStale(int bit) {
+		if (stale.Test(bit)) return;
+		stale.Set(bit);
+		staleCount++;
+	}
+
+	void MarkStale(const BitSet& changed) {
+		for (int k = 0; k < stale.WordCount(); k++)
+		{
+			staleCount += popCount64(changed.w[k] & ~stale.w[k]);
+			stale.w[k] |= changed.w[k];
+		}
+	}
+
+public:
+	// brings the move index up to date. A move depends on the cells up to two away
+	// from either of its cells, so only moves that close to a changed cell are
+	// checked again, unless so much changed that one full pass is cheaper.
+	void RefreshMoves() {
+		if (staleCount == 0) return;
+		if (staleCount * 36 > Cells())
+		{
+			LegalMoves(moveRight, moveUp);
+			moveCount = moveRight.Count() + moveUp.Count();
+			stale = BitSet(Cells());
+		}
+		else stale.ForEach([&](int bit) {
+			stale.Reset(bit);
+			int ci = bit / Height(), cj = bit % Height();
+			for (int i = ci - 3; i <= ci + 2; i++)
+				for (int j = cj - 3; j <= cj + 2; j++)
+				{
+					if (i < 0 || j < 0 || i >= Width() || j >= Height()) continue;
+					if (i + 1 < Width()) UpdateMove(moveRight, Bit(i, j), IsLegalSwap(i, j, i + 1, j));
+					if (j + 1 < Height()) UpdateMove(moveUp, Bit(i, j), IsLegalSwap(i, j, i, j + 1));
+				}
+		});
+		staleCount = 0;
+	}
+
+	int CountLegalMoves() {
+		RefreshMoves();
+		return moveCount;
+	}
+
+	bool HasLegalMoves() {
+		return CountLegalMoves() > 0;
+	}
+
+	void Seed(const Random& random) {
+		this->random = random;
+	}
+
+	// the stream Generate, Shuffle and the refills draw from, see Seed
+	const Random& getRandom() const { return random; }
+
+	// replaces the board with one given as an ID per cell, in bit order
+	void Load(const unsigned char* ids) {
+		for (int c = 0; c < Colors(); c++) planes[c] = BitSet(Cells());
+		for (int k = 0; k < Cells(); k++)
+			if (ids[k]) planes[ids[k] - 1].Set(k);
+		hash = 0;
+		for (int c = 0; c < Colors(); c++) planes[c].ForEach([&](int bit) { hash ^= zobristKey(c, bit); });
+		stale = cells;
+		staleCount = Cells();
+	}
+
+	// fills the board with random gems without a run and with at least one legal
+	// move. A move is planted first, then every cell draws from the colors that
+	// would not line up with two of its neighbors. False only if every attempt
+	// ran into a cell with all colors excluded.
+	bool Generate() {
+		const int W = Width(), H = Height(), N = Cells();
+		if (W < 3 || H < 2 || Colors() < 2) return false;
+		unsigned char local[1024];
+		std::vector<unsigned char> heap;
+		unsigned char* ids = N <= 1024 ? local : (heap.resize(N), &heap[0]);
+		const int colors = ((1 << (Colors() + 1)) - 1) & ~1;	// bit ID set for IDs 1..Colors()
+		Random random = this->random;	// a local copy stays in registers
+
+		for (int attempt = 0; attempt < 16; attempt++)
+		{
+			for (int k = 0; k < N; k++) ids[k] = 0;
+			// c c . on row y and c on row y + 1 above the gap, as in Shuffle
+			int x = random.Below(W - 2), y = random.Below(H - 1), planted = random.Below(Colors()) + 1;
+			ids[x * H + y] = ids[(x + 1) * H + y] = ids[(x + 2) * H + y + 1] = planted;
+
+			bool filled = true;
+			for (int i = 0; i < W && filled; i++)
+				for (int j = 0; j < H; j++)
+				{
+					int k = i * H + j;
+					if (ids[k]) continue;
+					// unfilled cells are 0 and only exclude the unused bit 0
+					int excluded = 0;
+					if (i >= 2) excluded |= (ids[k - H] == ids[k - 2 * H]) << ids[k - H];
+					if (j >= 2) excluded |= (ids[k - 1] == ids[k - 2]) << ids[k - 1];
+					if (i + 2 < W) excluded |= (ids[k + H] == ids[k + 2 * H]) << ids[k + H];
+					if (j + 2 < H) excluded |= (ids[k + 1] == ids[k + 2]) << ids[k + 1];
+					if (i >= 1 && i + 1 < W) excluded |= (ids[k - H] == ids[k + H]) << ids[k - H];
+					if (j >= 1 && j + 1 < H) excluded |= (ids[k - 1] == ids[k + 1]) << ids[k - 1];
+					int allowed = colors & ~excluded;
+					if (!allowed)
+					{
+						filled = false;
+						break;
+					}
+					ids[k] = nthBit.bit[allowed][random.Below(nthBit.count[allowed])];
+				}
+			if (!filled) continue;
+			Load(ids);
+			this->random = random;
+			return true;
+		}
+		this->random = random;
+		return false;
+	}
+
+	// permutes the gems into a layout without runs and with at least one legal
+	// move. source[k] is the cell whose gem moves to cell k; empty cells stay.
+	// One move is planted first, then cells are filled in order with a color that
+	// makes no run with the cells placed so far. A cell with no such color left is
+	// repaired by trading colors with a placed cell; the retries are bounded.
+	bool Shuffle(std::vector<int>& source) {
+		const int W = Width(), H = Height(), N = Cells();
+		std::vector<std::vector<int> > gems(Colors() + 1);	// cells holding each ID
+		for (int k = 0; k < N; k++) gems[Get(k / H, k % H)].push_back(k);
+
+		// a color with three gems for the planted move
+		int planted = 0;
+		for (int ID = 1; ID <= Colors(); ID++)
+			if (gems[ID].size() >= 3 && (!planted || gems[ID].size() > gems[planted].size())) planted = ID;
+		if (!planted || W < 3 || H < 2) return false;
+
+		std::vector<int> grid(N), count(Colors() + 1), order;
+		for (int attempt = 0; attempt < 16; attempt++)
+		{
+			// 0 is free, -1 an empty cell that matches nothing
+			for (int k = 0; k < N; k++) grid[k] = gems[0].empty() || Get(k / H, k % H) ? 0 : -1;
+			for (int ID = 1; ID <= Colors(); ID++) count[ID] = (int)gems[ID].size();
+
+			// c c . on row y and c on row y + 1 above the gap: swapping the gap up matches
+			int x = random.Below(W - 2), y = random.Below(H - 1);
+			int plant[3] = { x * H + y, (x + 1) * H + y, (x + 2) * H + y + 1 };
+			bool free = true;
+			for (int p = 0; p < 3; p++) free = free && grid[plant[p]] == 0;
+			if (!free) continue;
+			for (int p = 0; p < 3; p++) grid[plant[p]] = planted;
+			count[planted] -= 3;
+			if (MakesRun(grid, plant[0], planted) || MakesRun(grid, plant[2], planted)) continue;
+
+			bool filled = true;
+			order.clear();
+			for (int k = 0; k < N && filled; k++)
+			{
+				if (grid[k]) continue;
+				int ID = PickColor(grid, count, k);
+				if (!ID) ID = Repair(grid, count, order, k);
+				if (!ID) filled = false;
+				else
+				{
+					grid[k] = ID;
+					count[ID]--;
+					order.push_back(k);
+				}
+			}
+			if (!filled) continue;
+
+			// hand out the old cells of every color
+			std::vector<int> next(Colors() + 1, 0);
+			source.assign(N, 0);
+			for (int k = 0; k < N; k++)
+			{
+				int ID = grid[k] < 0 ? 0 : grid[k];
+				source[k] = gems[ID][next[ID]++];
+				Set(k / H, k % H, ID);
+			}
+			return true;
+		}
+		return false;
+	}
+
+private:
+	// would gem ID at cell k of the partly filled grid line up with two others
+	bool MakesRun(const std::vector<int>& grid, int k, int ID) const {
+		const int H = Height();
+		int i = k / H, j = k % H;
+		int left = 0, right = 0, down = 0, up = 0;
+		while (left < 2 && i - left - 1 >= 0 && grid[k - (left + 1) * H] == ID) left++;
+		while (right < 2 && i + right + 1 < Width() && grid[k + (right + 1) * H] == ID) right++;
+		while (down < 2 && j - down - 1 >= 0 && grid[k - down - 1] == ID) down++;
+		while (up < 2 && j + up + 1 < H && grid[k + up + 1] == ID) up++;
+		return left + right >= 2 || down + up >= 2;
+	}
+
+	// a random color still in stock that makes no run at cell k, 0 if there is none
+	int PickColor(const std::vector<int>& grid, const std::vector<int>& count, int k) {
+		int total = 0, weights[maxGemTypes + 1] = { 0 };
+		for (int ID = 1; ID <= Colors(); ID++)
+			if (count[ID] > 0 && !MakesRun(grid, k, ID))
+				total += weights[ID] = count[ID];
+		if (!total) return 0;
+		int r = random.Below(total);
+		for (int ID = 1; ID <= Colors(); ID++)
+			if ((r -= weights[ID]) < 0) return ID;
+		return 0;
+	}
+
+	// gives cell k a color taken from a placed cell, which takes a color still in
+	// stock instead; 0 if a few random tries find no trade without runs
+	int Repair(std::vector<int>& grid, std::vector<int>& count, const std::vector<int>& order, int k) {
+		if (order.empty()) return 0;
+		for (int tries = 0; tries < 32; tries++)
+		{
+			int p = order[random.Below((int)order.size())];
+			int taken = grid[p];
+			if (MakesRun(grid, k, taken)) continue;
+			for (int ID = 1; ID <= Colors(); ID++)
+			{
+				if (count[ID] == 0 || ID == taken) continue;
+				grid[p] = ID;
+				grid[k] = taken;
+				bool clean = !MakesRun(grid, p, ID);
+				grid[k] = 0;
+				if (clean)
+				{
+					count[ID]--;
+					count[taken]++;
+					return taken;
+				}
+				grid[p] = taken;
+			}
+		}
+		return 0;
+	}
 
 public:
-    Camera()
-    {
-        center = vec2(0.0, 0.0);
-        halfSize =  vec2(1.0, 1.0);
-		orientation = 0.0;
-		b = false;
-    }
+	// the indexed moves, as of the last refresh
+	const BitSet& getMovesRight() const { return moveRight; }
+	const BitSet& getMovesUp() const { return moveUp; }
+
+	// the first indexed move, false if there is none
+	bool Hint(int& i, int& j, int& u, int& v) {
+		RefreshMoves();
+		if (moveCount == 0) return false;
+		int bit = moveRight.First();
+		bool right = bit >= 0;
+		if (!right) bit = moveUp.First();
+		i = bit / Height();
+		j = bit % Height();
+		u = i + right;
+		v = j + !right;
+		return true;
+	}
 
-    mat4 GetViewTransformationMatrix()
-    {
-		float orientation_rad = orientation / 180 * M_PI;
-        mat4 T = mat4(
-                      1.0, 0.0, 0.0, 0.0,
-                      0.0, 1.0, 0.0, 0.0,
-                      0.0, 0.0, 1.0, 0.0,
-                      -center.x, -center.y, 0.0, 1.0);
+	// an indexed move drawn uniformly with the caller's stream, false if there is none
+	bool RandomMove(Random& stream, int& i, int& j, int& u, int& v) {
+		RefreshMoves();
+		if (moveCount == 0) return false;
+		int n = stream.Below(moveCount);
+		int right = moveRight.Count();
+		bool isRight = n < right;
+		int bit = isRight ? moveRight.NthSet(n) : moveUp.NthSet(n - right);
+		i = bit / Height();
+		j = bit % Height();
+		u = i + isRight;
+		v = j + !isRight;
+		return true;
+	}
+};
 
-        mat4 S = mat4(
-                      1.0 / halfSize.x, 0.0, 0.0, 0.0,
-                      0.0, 1.0 / halfSize.y, 0.0, 0.0,
-                      0.0, 0.0, 1.0, 0.0,
-                      0.0, 0.0, 0.0, 1.0);
-			mat4 R = mat4(cos(orientation_rad), sin(orientation_rad), 0, 0,
-				-sin(orientation_rad), cos(orientation_rad), 0, 0,
-				0, 0, 1, 0,
-				0, 0, 0, 1);
-		
+// specialized cores for the board modes we ship
+template<int W, int H, int C>
+using Board = BoardCore<FixedBoardSize<W, H, C>, BitBoard<(W * H + 63) / 64> >;
 
-        return T * R * S;
-    }
+// any other shape, sized at run time
+typedef BoardCore<RuntimeBoardSize, DynamicBitBoard> GenericBoard;
 
-	mat4 getInverseViewTransformationMatrix() {
+// calls f with a default board core of the given shape, specialized if we ship it
+template<class F>
+void WithBoardType(int width, int height, int colors, F f)
+{
+	if (width == 10 && height == 10 && colors == 6) f(Board<10, 10, 6>());
+	else if (width == 10 && height == 10 && colors == 5) f(Board<10, 10, 5>());
+	else if (width == 8 && height == 8 && colors == 5) f(Board<8, 8, 5>());
+	else if (width == 6 && height == 6 && colors == 4) f(Board<6, 6, 4>());
+	else f(GenericBoard(RuntimeBoardSize(width, height, colors)));
+}
 
-		float orientation_rad = orientation / 180 * M_PI;
-		mat4 T = mat4(
-			1.0, 0.0, 0.0, 0.0,
-			0.0, 1.0, 0.0, 0.0,
-			0.0, 0.0, 1.0, 0.0,
-			center.x, center.y, 0.0, 1.0);
+// a swap of cell (i, j) with its neighbor (u, v)
+struct BoardMove
+{
+	int i, j, u, v;
+};
 
-		mat4 S = mat4(
-			1.0 * halfSize.x, 0.0, 0.0, 0.0,
-			0.0, 1.0 * halfSize.y, 0.0, 0.0,
-			0.0, 0.0, 1.0, 0.0,
-			0.0, 0.0, 0.0, 1.0);
-		mat4 R = mat4(cos(-orientation_rad), sin(-orientation_rad), 0, 0,
-			sin(orientation_rad), cos(-orientation_rad), 0, 0,
-			0, 0, 1, 0,
-			0, 0, 0, 1);
+// a unit of work for a JobSystem. It is queued once every job it was submitted
+// after has finished; the handle stays valid as long as someone holds it.
+struct Job
+{
+	std::function<void()> task;
+	std::atomic<int> waiting;		// unfinished dependencies, plus one while Submit runs
+	std::atomic<bool> finished;
+	std::mutex lock;
+	std::vector<std::shared_ptr<Job> > next;	// jobs submitted after this one
 
-		return S * R * T;
+	Job(std::function<void()> task) : task(std::move(task)), waiting(1), finished(false) {}
+};
+
+typedef std::shared_ptr<Job> JobHandle;
+
+// share of the time a worker spent running jobs since the last sample
+struct WorkerUsage
+{
+	double busy;
+	long long jobs, steals;
+};
+
+// worker threads with a deque of jobs each. A worker runs its newest job first
+// and steals the oldest one of another worker when it runs dry, so jobs of
+// uneven length still keep every core busy. Jobs submitted from a worker go to
+// its own deque, others are dealt out round robin.
+class JobSystem
+{
+	struct Worker
+	{
+		std::mutex lock;
+		std::deque<JobHandle> jobs;
+		std::atomic<long long> run, steals, busy;	// since the last sample, busy in microseconds
+
+		Worker() : run(0), steals(0), busy(0) {}
+	};
+
+	// workers, plus the usage of jobs run by threads helping in Wait
+	std::vector<std::unique_ptr<Worker> > workers;
+	std::vector<std::thread> threads;
+	std::mutex sleepLock;
+	std::condition_variable wake, idle;
+	std::atomic<int> queued;		// jobs waiting in the deques
+	std::atomic<int> pending;		// jobs submitted and not finished yet
+	std::atomic<int> waiters;		// threads asleep in Wait
+	std::atomic<unsigned> next;		// the worker that gets the next job from outside
+	std::chrono::steady_clock::time_point since;	// start of the usage sample
+	bool stopping;
+
+	static thread_local JobSystem* owner;	// the system the current thread works for
+	static thread_local int self;
+	static thread_local int nesting;		// jobs running on the current thread, see TryRun
+
+	int Self() { return owner == this ? self : -1; }
+
+	void Queue(const JobHandle& job) {
+		int count = (int)workers.size() - 1;
+		int target = Self();
+		if (target < 0) target = next++ % count;
+		{
+			std::lock_guard<std::mutex> guard(workers[target]->lock);
+			workers[target]->jobs.push_back(job);
+		}
+		queued++;
+		std::lock_guard<std::mutex> guard(sleepLock);
+		wake.notify_one();
+		if (waiters > 0) idle.notify_all();
 	}
 
-    void SetAspectRatio(int width, int height)
-    {
-        halfSize = vec2((float)width / height,1.0);
-    }
+	void Finish(Job& job) {
+		std::vector<JobHandle> released;
+		{
+			std::lock_guard<std::mutex> guard(job.lock);
+			job.finished = true;
+			released.swap(job.next);
+		}
+		for (int k = 0; k < released.size(); k++)
+			if (--released[k]->waiting == 0) Queue(released[k]);
+		pending--;
+		if (waiters > 0)
+		{
+			std::lock_guard<std::mutex> guard(sleepLock);
+			idle.notify_all();
+		}
+	}
 
-    void Move(float dt)
-    {
-        if(keyboardState['j']) center = center + vec2(1.0 , 0.0) * dt;
-        if(keyboardState['l']) center = center + vec2(-1.0, 0.0) * dt;
-        if(keyboardState['k']) center = center + vec2(0.0, 1.0) * dt;
-        if(keyboardState['i']) center = center + vec2(0.0, -1.0) * dt;
+	// runs one job, from worker self's deque or stolen from another; false if all are empty
+	bool TryRun(int self) {
+		JobHandle job;
+		int count = (int)workers.size() - 1, victim = 0;
+		for (int k = 0; k < count && !job; k++)
+		{
+			victim = self < 0 ? k : (self + k) % count;
+			Worker& worker = *workers[victim];
+			std::lock_guard<std::mutex> guard(worker.lock);
+			if (worker.jobs.empty()) continue;
+			if (victim == self)
+			{
+				job = std::move(worker.jobs.back());
+				worker.jobs.pop_back();
+			}
+			else
+			{
+				job = std::move(worker.jobs.front());
+				worker.jobs.pop_front();
+			}
+		}
+		if (!job) return false;
+		queued--;
+		Worker& usage = *workers[self < 0 ? count : self];
+		if (self >= 0 && victim != self) usage.steals++;
+		// a job run while another waits on the same thread is already in its busy time
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		nesting++;
+		job->task();
+		nesting--;
+		job->task = nullptr;		// let go of whatever the task captured
+		if (nesting == 0) usage.busy += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+		usage.run++;
+		Finish(*job);
+		return true;
 	}
 
-	void Quake(float dt) {
-		center = center + vec2(0.001, 0.0) * dt; 
+	void Run(int worker) {
+		owner = this;
+		self = worker;
+		for (;;)
+		{
+			if (TryRun(worker)) continue;
+			std::unique_lock<std::mutex> guard(sleepLock);
+			wake.wait(guard, [&]() { return stopping || queued > 0; });
+			if (stopping) return;
+		}
 	}
 
-	void rotateCamClock() {
+	// sleeps until done() holds or there is a job to help with
+	template<class Done>
+	void Help(Done done) {
+		int worker = Self();
+		while (!done())
+		{
+			if (TryRun(worker)) continue;
+			std::unique_lock<std::mutex> guard(sleepLock);
+			waiters++;
+			idle.wait(guard, [&]() { return done() || queued > 0; });
+			waiters--;
+		}
+	}
 
-		if (!b) {
-			orientation += M_PI/2;
-			b = true;
+public:
+	// count worker threads, at least one
+	JobSystem(int count) : queued(0), pending(0), waiters(0), next(0), since(std::chrono::steady_clock::now()), stopping(false) {
+		if (count < 1) count = 1;
+		for (int k = 0; k <= count; k++) workers.push_back(std::unique_ptr<Worker>(new Worker()));
+		for (int k = 0; k < count; k++) threads.push_back(std::thread([this, k]() { Run(k); }));
+	}
+
+	~JobSystem() {
+		Wait();
+		{
+			std::lock_guard<std::mutex> guard(sleepLock);
+			stopping = true;
 		}
+		wake.notify_all();
+		for (int k = 0; k < threads.size(); k++) threads[k].join();
 	}
 
-	void rotateCamCount() {
+	int getWorkerCount() { return (int)workers.size() - 1; }
 
-		if (!b) {
-			orientation -= M_PI/2;
-			b = true;
+	// queues task to run once every job of after has finished
+	JobHandle Submit(std::function<void()> task, const std::vector<JobHandle>& after = std::vector<JobHandle>()) {
+		JobHandle job = std::make_shared<Job>(std::move(task));
+		pending++;
+		for (int k = 0; k < after.size(); k++)
+		{
+			std::lock_guard<std::mutex> guard(after[k]->lock);
+			if (after[k]->finished) continue;
+			job->waiting++;
+			after[k]->next.push_back(job);
 		}
+		if (--job->waiting == 0) Queue(job);
+		return job;
 	}
 
+	// returns when job has finished; the caller runs jobs meanwhile
+	void Wait(const JobHandle& job) {
+		Help([&]() { return (bool)job->finished; });
+	}
 
-	void reset() {
-		b = false;
+	// returns when every job of jobs has finished
+	void Wait(const std::vector<JobHandle>& jobs) {
+		for (int k = 0; k < jobs.size(); k++) Wait(jobs[k]);
 	}
 
-	
+	// returns when every submitted job has run
+	void Wait() {
+		Help([&]() { return pending == 0; });
+	}
+
+	// calls body(k) for every k in [begin, end), grain indices to a job. The
+	// caller does the first grain itself, so a range of one grain never leaves
+	// the calling thread.
+	template<class Body>
+	void ParallelFor(int begin, int end, int grain, const Body& body) {
+		if (grain < 1) grain = 1;
+		std::vector<JobHandle> chunks;
+		for (int first = begin + grain; first < end; first += grain)
+		{
+			int last = std::min(first + grain, end);
+			chunks.push_back(Submit([&body, first, last]() { for (int k = first; k < last; k++) body(k); }));
+		}
+		for (int k = begin; k < end && k < begin + grain; k++) body(k);
+		Wait(chunks);
+	}
+
+	// fills usage with one entry per worker, and a last one for the jobs other
+	// threads ran while waiting, and starts a new sample
+	void Sample(std::vector<WorkerUsage>& usage) {
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		double elapsed = std::chrono::duration_cast<std::chrono::microseconds>(now - since).count();
+		since = now;
+		usage.resize(workers.size());
+		for (int k = 0; k < workers.size(); k++)
+		{
+			usage[k].busy = elapsed > 0 ? workers[k]->busy.exchange(0) / elapsed : 0;
+			usage[k].jobs = workers[k]->run.exchange(0);
+			usage[k].steals = workers[k]->steals.exchange(0);
+		}
+	}
+
+	void PrintUtilization() {
+		std::vector<WorkerUsage> usage;
+		Sample(usage);
+		double total = 0;
+		for (int k = 0; k < usage.size(); k++)
+		{
+			if (k + 1 < usage.size()) printf("worker %d: %5.1f%% busy, %lld jobs, %lld stolen\n", k, usage[k].busy * 100, usage[k].jobs, usage[k].steals);
+			else printf("waiting threads: %5.1f%% of a core, %lld jobs\n", usage[k].busy * 100, usage[k].jobs);
+			total += usage[k].busy;
+		}
+		printf("%.2f of %d cores busy\n", total, (int)usage.size() - 1);
+	}
 };
 
-Camera camera;
+thread_local JobSystem* JobSystem::owner = 0;
+thread_local int JobSystem::self = -1;
+thread_local int JobSystem::nesting = 0;
 
+// the job system of the game and the batch simulation
+JobSystem* jobs = 0;
+// the AI's own workers. Draw waits on jobs, and a thread waiting on a job system
+// runs its jobs meanwhile, so a frame never ends up running a rollout.
+JobSystem* aiJobs = 0;
 
-class Geometry
+// a legal swap and the points it is expected to lead to
+struct RankedMove
 {
-protected:
-	unsigned int vao;
-
-public:
-	virtual void Draw() = 0;
-	Geometry()
-	{
-		glGenVertexArrays(1, &vao);
-	}
+	BoardMove move;
+	double value;
+	int rollouts;	// for AdviseMoves, the rollouts value is the mean of
+	int depth;		// for SearchMoves, the moves value looks ahead
 };
 
+// one rollout: the points of move on board and of up to depth random legal
+// moves after it, with refills drawn afresh. Played on game, which the caller
+// keeps from rollout to rollout so a generic board reuses its storage.
+template<class Core>
+long long Rollout(const Core& board, const BoardMove& move, int depth, Random& stream, Core& game)
+{
+	game = board;
+	game.Seed(Random(stream.Next()));
+	long long points = game.Play(move.i, move.j, move.u, move.v).score;
+	int i, j, u, v;
+	for (int k = 0; k < depth && game.RandomMove(stream, i, j, u, v); k++)
+		points += game.Play(i, j, u, v).score;
+	return points;
+}
 
-class Material
+// lanes independent boards of one shipped shape, laid out word by word across
+// the boards, so one vector instruction does a word of every board. Matching,
+// clearing and the legal moves run in lane kernels on all boards at once; the
+// collapse, the refill and picking a move stay per board. Columns fit a word.
+template<int W, int H, int C>
+struct BoardLanes
 {
-	Shader* shader;
-	vec4 color;
+	static_assert(H <= 64, "a column must fit a word");
+	static const int lanes = 8, words = (W * H + 63) / 64;
+	enum Op { MATCHES, CLEAR, MOVES };
+
+	unsigned long long planes[C][words][lanes];
+	unsigned long long matches[words][lanes], right[words][lanes], up[words][lanes];
+	// the masks of BoardCore, the same for every board
+	unsigned long long cells[words], runStarts[words], runEnds[words], runMiddles[words], hasRight[words], hasUp[words];
+	Random streams[lanes];		// the refills of every board
+
+	static void (*const run)(BoardLanes&, Op);
+
+	BoardLanes() {
+		for (int k = 0; k < words; k++) cells[k] = runStarts[k] = runEnds[k] = runMiddles[k] = hasRight[k] = hasUp[k] = 0;
+		for (int i = 0; i < W; i++)
+			for (int j = 0; j < H; j++)
+			{
+				int bit = i * H + j;
+				unsigned long long b = 1ull << (bit & 63);
+				cells[bit >> 6] |= b;
+				if (j + 2 < H) runStarts[bit >> 6] |= b;
+				if (j >= 2) runEnds[bit >> 6] |= b;
+				if (j >= 1 && j + 1 < H) runMiddles[bit >> 6] |= b;
+				if (i + 1 < W) hasRight[bit >> 6] |= b;
+				if (j + 1 < H) hasUp[bit >> 6] |= b;
+			}
+	}
 
-public:
-	Material(Shader* shader, vec4 color)
-	{
-		this->shader = shader;
-		this->color = color;
+	void Load(int lane, const Board<W, H, C>& board) {
+		for (int c = 0; c < C; c++)
+			for (int k = 0; k < words; k++) planes[c][k][lane] = board.Plane(c + 1).w[k];
 	}
 
-	void UploadAttributes()
-	{
-		shader->UploadColor(color);
+	int Get(int lane, int bit) const {
+		int ID = 0;
+		for (int c = 0; c < C; c++) ID |= ((planes[c][bit >> 6][lane] >> (bit & 63)) & 1) * (c + 1);
+		return ID;
+	}
+
+	void Swap(int lane, int a, int b) {
+		for (int c = 0; c < C; c++)
+		{
+			unsigned long long& x = planes[c][a >> 6][lane];
+			unsigned long long& y = planes[c][b >> 6][lane];
+			int bitA = (x >> (a & 63)) & 1, bitB = (y >> (b & 63)) & 1;
+			x = (x & ~(1ull << (a & 63))) | (unsigned long long)bitB << (a & 63);
+			y = (y & ~(1ull << (b & 63))) | (unsigned long long)bitA << (b & 63);
+		}
 	}
-};
 
+	int Count(const unsigned long long (&set)[words][lanes], int lane) const {
+		int count = 0;
+		for (int k = 0; k < words; k++) count += popCount64(set[k][lane]);
+		return count;
+	}
 
+	// drops the gems of one board, as BoardCore::Collapse; only the columns with a match change
+	void Collapse(int lane) {
+		int last = -1;
+		for (int k = 0; k < words; k++)
+			for (unsigned long long cleared = matches[k][lane]; cleared; cleared &= cleared - 1)
+			{
+				int i = (k * 64 + countTrailingZeros64(cleared)) / H;
+				if (i != last) CollapseColumn(lane, i);
+				last = i;
+			}
+	}
 
-class Mesh
-{
-	Geometry* geometry;
-	Material* material;
+	void CollapseColumn(int lane, int i) {
+		const unsigned long long column = H == 64 ? ~0ull : (1ull << H) - 1;
+		int bit = i * H, k = bit >> 6, m = bit & 63;
+		unsigned long long chunk[maxGemTypes], occupied = 0;
+		for (int c = 0; c < C; c++)
+		{
+			unsigned long long bits = planes[c][k][lane] >> m;
+			if (m + H > 64) bits |= planes[c][k + 1][lane] << (64 - m);
+			occupied |= chunk[c] = bits & column;
+		}
+		if (occupied == column) return;
+		collapseColumn(chunk, C, occupied);
+		for (int c = 0; c < C; c++)
+		{
+			unsigned long long& low = planes[c][k][lane];
+			low = (low & ~(column << m)) | (chunk[c] << m);
+			if (m + H > 64)
+			{
+				unsigned long long& high = planes[c][k + 1][lane];
+				high = (high & ~(column >> (64 - m))) | (chunk[c] >> (64 - m));
+			}
+		}
+	}
 
-public:
-	Mesh(Geometry* geometry, Material* material)
-	{
-		this->material = material;
-		this->geometry = geometry;
+	// fills the empty cells of one board, as BoardCore::Refill
+	void Refill(int lane) {
+		unsigned char ids[W * H];
+		for (int k = 0; k < words; k++)
+		{
+			unsigned long long empty = cells[k];
+			for (int c = 0; c < C; c++) empty &= ~planes[c][k][lane];
+			int count = popCount64(empty);
+			if (count == 0) continue;
+			streams[lane].Fill(ids, count, C, 0);
+			int n = 0;
+			for (; empty; empty &= empty - 1) planes[ids[n++]][k][lane] |= 1ull << countTrailingZeros64(empty);
+		}
 	}
 
-	void Draw()
-	{
-		material->UploadAttributes();
-		geometry->Draw();
+	// clears, collapses and refills every board until none has a match; the points of each go to score
+	void Resolve(long long* score) {
+		int chain[lanes] = {};
+		for (;;)
+		{
+			run(*this, MATCHES);
+			bool any = false;
+			int count[lanes];
+			for (int lane = 0; lane < lanes; lane++) any |= (count[lane] = Count(matches, lane)) > 0;
+			if (!any) return;
+			run(*this, CLEAR);
+			for (int lane = 0; lane < lanes; lane++)
+			{
+				if (!count[lane]) continue;
+				score[lane] += 10ll * count[lane] * ++chain[lane];
+				Collapse(lane);
+				Refill(lane);
+			}
+		}
+	}
+
+	// swaps a random legal pair on every board that has one, false for a board without
+	void RandomMoves(bool* moved) {
+		run(*this, MOVES);
+		for (int lane = 0; lane < lanes; lane++)
+		{
+			int rights = Count(right, lane), count = rights + Count(up, lane);
+			moved[lane] = count > 0;
+			if (!count) continue;
+			int n = streams[lane].Below(count);
+			bool isRight = n < rights;
+			const unsigned long long (&set)[words][lanes] = isRight ? right : up;
+			if (!isRight) n -= rights;
+			int bit = 0;
+			for (int k = 0; k < words; k++)
+			{
+				unsigned long long word = set[k][lane];
+				int inWord = popCount64(word);
+				if (n >= inWord)
+				{
+					n -= inWord;
+					continue;
+				}
+				for (; n > 0; n--) word &= word - 1;
+				bit = k * 64 + countTrailingZeros64(word);
+				break;
+			}
+			Swap(lane, bit, isRight ? bit + H : bit + 1);
+		}
 	}
 };
 
-class Object
+// the lane kernels, written once for every instruction set in L. Shifting the
+// board down by S cells brings the cell S bits up into each bit, across words.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpsabi"
+#endif
+template<class L, int W, int H, int C>
+struct LaneKernels
 {
-	Shader* shader;
-	Mesh* mesh;
-	vec2 position;
-	vec2 scaling;
-	float orientation;
-	int ID;
-	bool d;
+	typedef BoardLanes<W, H, C> Lanes;
+	typedef typename L::V V;
+	static const int words = Lanes::words;
+
+	template<int S>
+	static BITS_INLINE V Down(const V* w, int k) {
+		const int q = S / 64, r = S % 64;
+		V low = k + q < words ? w[k + q] : L::Zero();
+		V high = k + q + 1 < words ? w[k + q + 1] : L::Zero();
+		return L::Or(L::template Right<r>(low), r ? L::template Left<64 - r>(high) : L::Zero());
+	}
 
-public:
-	Object(Shader* shader, Mesh* mesh, vec2 position, vec2 scaling, float orientation, int ID)
-	{
-		this->shader = shader;
-		this->mesh = mesh;
-		this->position = position;
-		this->scaling = scaling;
-		this->orientation = orientation;
-		this->ID = ID;
-		d = false;
+	template<int S>
+	static BITS_INLINE V Up(const V* w, int k) {
+		const int q = S / 64, r = S % 64;
+		V high = k - q >= 0 ? w[k - q] : L::Zero();
+		V low = k - q - 1 >= 0 ? w[k - q - 1] : L::Zero();
+		return L::Or(L::template Left<r>(high), r ? L::template Right<64 - r>(low) : L::Zero());
+	}
+
+	static BITS_INLINE void Matches(Lanes& b, int g) {
+		V m[words], w[words], h[words], v[words];
+		for (int k = 0; k < words; k++) m[k] = L::Zero();
+		for (int c = 0; c < C; c++)
+		{
+			for (int k = 0; k < words; k++) w[k] = L::Load(&b.planes[c][k][g]);
+			for (int k = 0; k < words; k++)
+			{
+				h[k] = L::And(L::And(w[k], Down<H>(w, k)), Down<2 * H>(w, k));
+				v[k] = L::And(L::And(L::And(w[k], Down<1>(w, k)), Down<2>(w, k)), L::Broadcast(b.runStarts[k]));
+			}
+			for (int k = 0; k < words; k++)
+				m[k] = L::Or(L::Or(L::Or(m[k], h[k]), L::Or(Up<H>(h, k), Up<2 * H>(h, k))),
+					L::Or(L::Or(v[k], Up<1>(v, k)), Up<2>(v, k)));
+		}
+		for (int k = 0; k < words; k++) L::Store(&b.matches[k][g], m[k]);
+	}
+
+	static BITS_INLINE void Clear(Lanes& b, int g) {
+		for (int k = 0; k < words; k++)
+		{
+			V m = L::Load(&b.matches[k][g]);
+			for (int c = 0; c < C; c++) L::Store(&b.planes[c][k][g], L::AndNot(L::Load(&b.planes[c][k][g]), m));
+		}
+	}
+
+	// BoardCore::LegalMoves, word by word
+	static BITS_INLINE void Moves(Lanes& b, int g) {
+		V right[words], up[words], sameRight[words], sameUp[words];
+		V w[words], vertical[words], horizontal[words], below2[words], above2[words], toRight[words], toUp[words];
+		for (int k = 0; k < words; k++) right[k] = up[k] = sameRight[k] = sameUp[k] = L::Zero();
+		for (int c = 0; c < C; c++)
+		{
+			for (int k = 0; k < words; k++) w[k] = L::Load(&b.planes[c][k][g]);
+			for (int k = 0; k < words; k++)
+			{
+				V cells = L::Broadcast(b.cells[k]);
+				V left2 = L::And(L::And(Up<H>(w, k), Up<2 * H>(w, k)), cells);
+				V right2 = L::And(Down<H>(w, k), Down<2 * H>(w, k));
+				V sides = L::And(L::And(Up<H>(w, k), Down<H>(w, k)), cells);
+				below2[k] = L::And(L::And(Up<1>(w, k), Up<2>(w, k)), L::Broadcast(b.runEnds[k]));
+				above2[k] = L::And(L::And(Down<1>(w, k), Down<2>(w, k)), L::Broadcast(b.runStarts[k]));
+				V around = L::And(L::And(Up<1>(w, k), Down<1>(w, k)), L::Broadcast(b.runMiddles[k]));
+				vertical[k] = L::Or(L::Or(below2[k], above2[k]), around);
+				horizontal[k] = L::Or(L::Or(left2, right2), sides);
+				toRight[k] = L::Or(right2, vertical[k]);
+				toUp[k] = L::Or(horizontal[k], above2[k]);
+				vertical[k] = L::Or(left2, vertical[k]);
+				horizontal[k] = L::Or(horizontal[k], below2[k]);
+			}
+			for (int k = 0; k < words; k++)
+			{
+				right[k] = L::Or(right[k], L::Or(L::And(Down<H>(w, k), vertical[k]), L::And(w[k], Down<H>(toRight, k))));
+				up[k] = L::Or(up[k], L::Or(L::And(Down<1>(w, k), horizontal[k]), L::And(w[k], Down<1>(toUp, k))));
+				sameRight[k] = L::Or(sameRight[k], L::And(w[k], Down<H>(w, k)));
+				sameUp[k] = L::Or(sameUp[k], L::And(w[k], Down<1>(w, k)));
+			}
+		}
+		for (int k = 0; k < words; k++)
+		{
+			L::Store(&b.right[k][g], L::AndNot(L::And(right[k], L::Broadcast(b.hasRight[k])), sameRight[k]));
+			L::Store(&b.up[k][g], L::AndNot(L::And(up[k], L::Broadcast(b.hasUp[k])), sameUp[k]));
+		}
+	}
+
+	static BITS_INLINE void Run(Lanes& b, typename Lanes::Op op) {
+		for (int g = 0; g < Lanes::lanes; g += L::width)
+			if (op == Lanes::MATCHES) Matches(b, g);
+			else if (op == Lanes::CLEAR) Clear(b, g);
+			else Moves(b, g);
 	}
+};
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+// the kernels compiled for each instruction set, picked once at startup. A
+// static member of a template may be initialized before laneSet, so it asks the CPU itself.
+template<int W, int H, int C>
+void runLanesScalar(BoardLanes<W, H, C>& b, typename BoardLanes<W, H, C>::Op op) { LaneKernels<ScalarLanes, W, H, C>::Run(b, op); }
+
+#if defined(__x86_64__) || defined(_M_X64)
+template<int W, int H, int C>
+TARGET_SSE2 void runLanesSse2(BoardLanes<W, H, C>& b, typename BoardLanes<W, H, C>::Op op) { LaneKernels<Sse2Lanes, W, H, C>::Run(b, op); }
+
+template<int W, int H, int C>
+TARGET_AVX2 void runLanesAvx2(BoardLanes<W, H, C>& b, typename BoardLanes<W, H, C>::Op op) { LaneKernels<Avx2Lanes, W, H, C>::Run(b, op); }
+
+template<int W, int H, int C>
+TARGET_AVX512 void runLanesAvx512(BoardLanes<W, H, C>& b, typename BoardLanes<W, H, C>::Op op) { LaneKernels<Avx512Lanes, W, H, C>::Run(b, op); }
+#endif
+
+template<int W, int H, int C>
+void(*pickLaneKernels(LaneSet set))(BoardLanes<W, H, C>&, typename BoardLanes<W, H, C>::Op)
+{
+#if defined(__x86_64__) || defined(_M_X64)
+	if (set == LANES_AVX512) return runLanesAvx512<W, H, C>;
+	if (set == LANES_AVX2) return runLanesAvx2<W, H, C>;
+	if (set == LANES_SSE2) return runLanesSse2<W, H, C>;
+#endif
+	return runLanesScalar<W, H, C>;
+}
+
+template<int W, int H, int C>
+void(*const BoardLanes<W, H, C>::run)(BoardLanes<W, H, C>&, typename BoardLanes<W, H, C>::Op) = pickLaneKernels<W, H, C>(bestLaneSet());
+
+// what a caller of Rollouts keeps from call to call, so rollouts allocate nothing:
+// the board one-board rollouts play on and, for a shipped shape, the lanes. batch
+// is the fewest rollouts worth a call.
+template<class Core>
+struct RolloutScratch
+{
+	static const int batch = 1;
+	Core game;
+
+	RolloutScratch(const Core& shape) : game(shape) {}
+};
 
-	void UploadAttributes()
-	{
-		mat4 S = mat4(scaling.x, 0, 0, 0,
-			0, scaling.y, 0, 0,
-			0, 0, 1, 0,
-			0, 0, 0, 1);
-		float orientation_rad = (orientation * M_PI) / 180;
-		mat4 R = mat4(cos(orientation_rad), sin(orientation_rad), 0, 0,
-			-sin(orientation_rad), cos(orientation_rad), 0, 0,
-			0, 0, 1, 0,
-			0, 0, 0, 1);
-		mat4 T = mat4(1, 0, 0, 0,
-			0, 1, 0, 0,
-			0, 0, 1, 0,
-			position.x, position.y, 0, 1);
-		mat4 V = camera.GetViewTransformationMatrix();
+template<int W, int H, int C>
+struct RolloutScratch<Board<W, H, C> >
+{
+	static const int batch = BoardLanes<W, H, C>::lanes;
+	Board<W, H, C> game;
+	std::unique_ptr<BoardLanes<W, H, C> > lanes;
 
-		mat4 M = S * R * T * V; // scaling, rotation, and translation
+	RolloutScratch(const Board<W, H, C>& shape) : game(shape), lanes(new BoardLanes<W, H, C>()) {}
+};
 
-		shader->UploadM(M);
+// the points of count rollouts of move, see Rollout
+template<class Core>
+long long Rollouts(const Core& board, const BoardMove& move, int depth, int count, Random& stream, RolloutScratch<Core>& scratch)
+{
+	long long sum = 0;
+	for (int r = 0; r < count; r++) sum += Rollout(board, move, depth, stream, scratch.game);
+	return sum;
+}
+
+// a shipped shape plays its rollouts eight at a time in BoardLanes
+template<int W, int H, int C>
+long long Rollouts(const Board<W, H, C>& board, const BoardMove& move, int depth, int count, Random& stream,
+	RolloutScratch<Board<W, H, C> >& scratch)
+{
+	typedef BoardLanes<W, H, C> Lanes;
+	long long sum = 0;
+	int r = 0;
+	if (count >= Lanes::lanes && board.IsLegalSwap(move.i, move.j, move.u, move.v))
+	{
+		Lanes* lanes = scratch.lanes.get();
+		for (; r + Lanes::lanes <= count; r += Lanes::lanes)
+		{
+			long long score[Lanes::lanes] = {};
+			bool moved[Lanes::lanes];
+			for (int lane = 0; lane < Lanes::lanes; lane++)
+			{
+				lanes->Load(lane, board);
+				lanes->streams[lane] = Random(stream.Next());
+				lanes->Swap(lane, move.i * H + move.j, move.u * H + move.v);
+			}
+			lanes->Resolve(score);
+			for (int k = 0; k < depth; k++)
+			{
+				lanes->RandomMoves(moved);
+				lanes->Resolve(score);
+			}
+			for (int lane = 0; lane < Lanes::lanes; lane++) sum += score[lane];
+		}
 	}
+	for (; r < count; r++) sum += Rollout(board, move, depth, stream, scratch.game);
+	return sum;
+}
 
+// the order of AdviseMoves results: best mean first, swaps without rollouts last
+inline bool advisedBefore(const RankedMove& a, const RankedMove& b) {
+	if ((a.rollouts == 0) != (b.rollouts == 0)) return b.rollouts == 0;
+	return a.value > b.value;
+}
 
-	int getID() {
-		return ID;
+// rates every legal swap of board by Monte Carlo rollouts, see Rollout. Batches
+// of rollouts, as small as RolloutScratch allows, run on the pool, taking the
+// swaps round robin, and none is started once seconds have passed. ranked comes
+// out in advisedBefore order.
+template<class Core>
+void AdviseMoves(const Core& board, JobSystem& pool, double seconds, Random& random,
+	std::vector<RankedMove>& ranked, int depth = 3)
+{
+	const int batch = RolloutScratch<Core>::batch;
+	Core root = board;
+	ranked.clear();
+	const int H = root.Height();
+	root.RefreshMoves();
+	root.getMovesRight().ForEach([&](int bit) { ranked.push_back(RankedMove{ BoardMove{ bit / H, bit % H, bit / H + 1, bit % H }, 0, 0 }); });
+	root.getMovesUp().ForEach([&](int bit) { ranked.push_back(RankedMove{ BoardMove{ bit / H, bit % H, bit / H, bit % H + 1 }, 0, 0 }); });
+	const int moves = (int)ranked.size();
+	if (moves == 0) return;
+
+	std::unique_ptr<std::atomic<long long>[]> scores(new std::atomic<long long>[moves]);
+	std::unique_ptr<std::atomic<int>[]> rollouts(new std::atomic<int>[moves]);
+	for (int m = 0; m < moves; m++)
+	{
+		scores[m] = 0;
+		rollouts[m] = 0;
 	}
+	std::atomic<int> nextMove(0);
+	std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() +
+		std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds));
 
-	vec2 getScale() {
-		return scaling;
+	// a few tasks per worker, each with a stream of its own; they take the swaps round robin
+	std::vector<JobHandle> tasks;
+	for (int task = 0; task < pool.getWorkerCount() * 4; task++)
+	{
+		Random stream = random.Split();
+		tasks.push_back(pool.Submit([&, stream]() mutable {
+			RolloutScratch<Core> scratch(root);
+			while (std::chrono::steady_clock::now() < deadline)
+			{
+				int started = nextMove++;
+				long long sum = Rollouts(root, ranked[started % moves].move, depth, batch, stream, scratch);
+				scores[started % moves] += sum;
+				rollouts[started % moves] += batch;
+			}
+		}));
 	}
+	pool.Wait(tasks);
 
-	void Scale(float dt) {
-		scaling.x = scaling.x *dt;
-		scaling.y = scaling.y * dt;
+	for (int m = 0; m < moves; m++)
+	{
+		ranked[m].rollouts = rollouts[m];
+		ranked[m].value = ranked[m].rollouts ? (double)scores[m] / ranked[m].rollouts : 0;
 	}
+	std::stable_sort(ranked.begin(), ranked.end(), advisedBefore);
+}
 
-	vec2 getPosition() {
-		return position;
+// adds the rollouts of more, from another AdviseMoves on the same board, to total.
+// total comes out in advisedBefore order.
+void MergeRankedMoves(std::vector<RankedMove>& total, const std::vector<RankedMove>& more)
+{
+	for (int k = 0; k < more.size(); k++)
+	{
+		int m = 0;
+		while (m < total.size() && (total[m].move.i != more[k].move.i || total[m].move.j != more[k].move.j ||
+			total[m].move.u != more[k].move.u || total[m].move.v != more[k].move.v)) m++;
+		if (m == total.size())
+		{
+			total.push_back(more[k]);
+			continue;
+		}
+		int rollouts = total[m].rollouts + more[k].rollouts;
+		if (rollouts > 0) total[m].value = (total[m].value * total[m].rollouts + more[k].value * more[k].rollouts) / rollouts;
+		total[m].rollouts = rollouts;
 	}
+	std::stable_sort(total.begin(), total.end(), advisedBefore);
+}
 
-	void setPosition(vec2 position) {
-		this->position = position;
-	}
+// search values shared between threads without locks. An entry holds the data
+// and the key xor the data; a torn entry written by two threads at once fails
+// the check on probe and reads as a miss instead of a wrong value.
+class TranspositionTable
+{
+	struct Entry
+	{
+		std::atomic<unsigned long long> check;
+		std::atomic<unsigned long long> data;
+	};
 
-	float getOrientation() {
-		return orientation;
+	std::unique_ptr<Entry[]> entries;
+	unsigned long long mask;
+
+public:
+	// 2^bits entries of 16 bytes
+	TranspositionTable(int bits) : entries(new Entry[1ull << bits]), mask((1ull << bits) - 1) {
+		Clear();
 	}
 
-	void setOrientation(float orientation) {
-		this->orientation = orientation;
+	void Clear() {
+		for (unsigned long long k = 0; k <= mask; k++)
+		{
+			entries[k].check.store(0, std::memory_order_relaxed);
+			entries[k].data.store(0, std::memory_order_relaxed);
+		}
 	}
 
-	void Rotate(float dt) {
-		orientation += 0.1 * dt;
+	bool Probe(unsigned long long key, unsigned long long& data) const {
+		const Entry& entry = entries[key & mask];
+		data = entry.data.load(std::memory_order_relaxed);
+		return (entry.check.load(std::memory_order_relaxed) ^ data) == key && data != 0;
 	}
 
-	void DeleteBlock() {
-		d = true;
+	// replaces whatever the slot held; data must not be 0, which marks an empty slot
+	void Store(unsigned long long key, unsigned long long data) {
+		Entry& entry = entries[key & mask];
+		entry.check.store(key ^ data, std::memory_order_relaxed);
+		entry.data.store(data, std::memory_order_relaxed);
 	}
 
-	void CheckD() {
-		if (d) {
-			Scale(0.999);
-			Rotate(-4);
-		}
+	bool Probe(unsigned long long key, float& value) const {
+		unsigned long long data;
+		if (!Probe(key, data)) return false;
+		unsigned int bits = (unsigned int)data;
+		memcpy(&value, &bits, sizeof value);
+		return true;
 	}
 
-	void Draw()
-	{
-		UploadAttributes();
-		mesh->Draw();
+	void Store(unsigned long long key, float value) {
+		unsigned int bits;
+		memcpy(&bits, &value, sizeof bits);
+		Store(key, (1ull << 32) | bits);
 	}
 };
 
-
-class Triangle : public Geometry
+// the best swap found for a board and its value
+struct Analysis
 {
-	unsigned int vbo;	// vertex array object id
+	BoardMove move;
+	float value;
+	int depth;		// 1 to 127
+};
 
-public:
-	Triangle()
+// the swap of the mirrored cells, the left or lower cell first
+BoardMove MirrorMove(const BoardMove& move, int width)
+{
+	BoardMove mirrored = { width - 1 - move.i, move.j, width - 1 - move.u, move.v };
+	if (mirrored.u < mirrored.i)
 	{
-		glBindVertexArray(vao);		// make it active
-
-		glGenBuffers(1, &vbo);		// generate a vertex buffer object
-
-									// vertex coordinates: vbo -> Attrib Array 0 -> vertexPosition of the vertex shader
-		glBindBuffer(GL_ARRAY_BUFFER, vbo); // make it active, it is an array
-		static float vertexCoords[] = { -0.5, -0.5, 0.5, -0.5, -0.5, 0.5 };	// vertex data on the CPU
-
-		glBufferData(GL_ARRAY_BUFFER,	// copy to the GPU
-			sizeof(vertexCoords),	// size of the vbo in bytes
-			vertexCoords,		// address of the data array on the CPU
-			GL_STATIC_DRAW);	// copy to that part of the memory which is not modified
+		std::swap(mirrored.i, mirrored.u);
+		std::swap(mirrored.j, mirrored.v);
+	}
+	return mirrored;
+}
 
-								// map Attribute Array 0 to the currently bound vertex buffer (vbo)
-		glEnableVertexAttribArray(0);
+// analysis results keyed by BoardCore::CanonicalKey in 16 bytes an entry, so a
+// result found for one board serves its mirror image and every renaming of its
+// colors as well. Moves are kept as they are on the canonical board.
+class AnalysisCache
+{
+	TranspositionTable table;
 
-		// data organization of Attribute Array 0
-		glVertexAttribPointer(0,	// Attribute Array 0
-			2, GL_FLOAT,		// components/attribute, component type
-			GL_FALSE,		// not in fixed point format, do not normalized
-			0, NULL);		// stride and offset: it is tightly packed
+public:
+	// 2^bits entries
+	AnalysisCache(int bits) : table(bits) {}
+
+	// key and mirrored as given by CanonicalKey for a board width cells wide
+	bool Find(unsigned long long key, bool mirrored, int width, int height, Analysis& analysis) const {
+		unsigned long long data;
+		if (!table.Probe(key, data)) return false;
+		unsigned int bits = (unsigned int)data;
+		memcpy(&analysis.value, &bits, sizeof bits);
+		int bit = (int)((data >> 32) & 0xffffff);
+		bool up = (data >> 56) & 1;
+		analysis.depth = (int)(data >> 57);
+		analysis.move = BoardMove{ bit / height, bit % height, bit / height + !up, bit % height + up };
+		if (mirrored) analysis.move = MirrorMove(analysis.move, width);
+		return true;
 	}
 
-	void Draw()
-	{
-		glBindVertexArray(vao);	// make the vao and its vbos active playing the role of the data source
-		glDrawArrays(GL_TRIANGLES, 0, 3); // draw a single triangle with vertices defined in vao
+	void Store(unsigned long long key, bool mirrored, int width, int height, const Analysis& analysis) {
+		BoardMove move = mirrored ? MirrorMove(analysis.move, width) : analysis.move;
+		unsigned int bits;
+		memcpy(&bits, &analysis.value, sizeof bits);
+		unsigned long long bit = move.i * height + move.j;
+		table.Store(key, bits | bit << 32 | (unsigned long long)(move.v != move.j) << 56 | (unsigned long long)analysis.depth << 57);
 	}
 };
 
-class Quad : public Geometry
+// depth-limited expectimax over swaps and refills. A max node takes the best
+// legal swap, a chance node averages the points of samples resolutions of the
+// swap, each with its refills drawn from a stream seeded by the board hash, the
+// swap and the sample. The samples are the same wherever the board comes up
+// again, so values keyed by hash and depth can be shared through the table. The
+// incremental hash keeps the key free; canonical keys are left to the root.
+template<class Core>
+class ExpectimaxSearch
 {
-	unsigned int vbo;
+	TranspositionTable& table;
+	int samples;
+	std::chrono::steady_clock::time_point deadline;
+	std::atomic<bool>& stopped;		// set once the deadline passed, the values since are worthless
+	bool mayStop;
+
+	static unsigned long long TableKey(unsigned long long hash, int depth) {
+		return hash ^ zobristKey(maxGemTypes, depth);
+	}
 
 public:
-	Quad()
-	{
-		glBindVertexArray(vao);
-
-		glGenBuffers(1, &vbo);
+	ExpectimaxSearch(TranspositionTable& table, int samples, std::chrono::steady_clock::time_point deadline,
+		std::atomic<bool>& stopped, bool mayStop)
+		: table(table), samples(samples), deadline(deadline), stopped(stopped), mayStop(mayStop) {}
+
+	// true once the search may stop and the deadline has passed. Every sample plays
+	// a whole move, so the clock is cheap next to it, and a node of a big board
+	// does not run long past the deadline.
+	bool Expired() {
+		if (mayStop && !stopped && std::chrono::steady_clock::now() >= deadline) stopped = true;
+		return stopped;
+	}
 
-		glBindBuffer(GL_ARRAY_BUFFER, vbo);
-		static float vertexCoords[12];
-		vertexCoords[0] = 0;
-		vertexCoords[1] = 0;
-		float A = M_PI / 2;
-		for (int i = 1; i < 6; i++)
+	// the mean points of swap (i, j) (u, v) and the best depth - 1 moves after it, over count samples
+	float Chance(const Core& board, int i, int j, int u, int v, int depth, int count) {
+		unsigned long long seed = board.Hash() ^ zobristKey(maxGemTypes + 1 + (u > i), i * board.Height() + j);
+		float sum = 0;
+		for (int s = 0; s < count; s++)
 		{
-			vertexCoords[i * 2] = cos(A) * .75;
-			vertexCoords[i * 2 + 1] = sin(A) * .75;
-			A += M_PI / 2;
+			if (Expired()) return 0;
+			Core child = board;
+			child.Seed(Random(seed + s));
+			sum += child.Play(i, j, u, v).score;
+			if (depth > 1) sum += Max(child, depth - 1);
 		}
+		return sum / count;
+	}
 
+	// the expected points of the best depth moves, 0 without a legal move
+	float Max(Core& board, int depth) {
+		if (stopped) return 0;
+		unsigned long long key = TableKey(board.Hash(), depth);
+		float best = 0;
+		if (table.Probe(key, best)) return best;
+		const int H = board.Height();
+		board.RefreshMoves();
+		board.getMovesRight().ForEach([&](int bit) { best = std::max(best, Chance(board, bit / H, bit % H, bit / H + 1, bit % H, depth, samples)); });
+		board.getMovesUp().ForEach([&](int bit) { best = std::max(best, Chance(board, bit / H, bit % H, bit / H, bit % H + 1, depth, samples)); });
+		if (!stopped) table.Store(key, best);
+		return best;
+	}
+};
 
-		//static float vertexCoords[] = { 0, 0, 1, 0, 0, 1, 1, 1 };
-		glBufferData(GL_ARRAY_BUFFER,	// copy to the GPU
-			sizeof(vertexCoords),	// size of the vbo in bytes
-			vertexCoords,		// address of the data array on the CPU
-			GL_STATIC_DRAW);	// copy to that part of the memory which is not modified
+// where SearchMoves left off on a board, for a later call to go on with: the
+// swaps with the values of the last complete depth, and the depth under way
+// with the swaps already done at it. A default one starts afresh.
+struct SearchProgress
+{
+	int depth;
+	std::vector<RankedMove> ranked;
+	std::vector<float> values;
+	std::vector<char> done;
 
-								// map Attribute Array 0 to the currently bound vertex buffer (vbo)
-		glEnableVertexAttribArray(0);
+	SearchProgress() : depth(0) {}
+};
 
-		// data organization of Attribute Array 0
-		glVertexAttribPointer(0,	// Attribute Array 0
-			2, GL_FLOAT,		// components/attribute, component type
-			GL_FALSE,		// not in fixed point format, do not normalized
-			0, NULL);		// stride and offset: it is tightly packed
+// ranks the legal swaps of board by ExpectimaxSearch, deepening one move at a
+// time until seconds have passed. Each depth runs the swaps as tasks on the
+// pool; a depth cut off by the deadline is dropped and the last complete one
+// stands, depth 1 always completes. Given progress, the search goes on from it
+// and keeps every swap finished at a cut off depth instead, depth 1 included,
+// so short calls add up. ranked comes out best first, depth 0 if no depth is
+// complete yet.
+template<class Core>
+void SearchMoves(const Core& board, JobSystem& pool, TranspositionTable& table, double seconds,
+	std::vector<RankedMove>& ranked, SearchProgress* progress = 0, int samples = 4, int rootSamples = 16, int maxDepth = 8)
+{
+	SearchProgress fresh;
+	SearchProgress& state = progress ? *progress : fresh;
+	Core root = board;
+	if (state.depth == 0)
+	{
+		const int H = root.Height();
+		root.RefreshMoves();
+		root.getMovesRight().ForEach([&](int bit) { state.ranked.push_back(RankedMove{ BoardMove{ bit / H, bit % H, bit / H + 1, bit % H } }); });
+		root.getMovesUp().ForEach([&](int bit) { state.ranked.push_back(RankedMove{ BoardMove{ bit / H, bit % H, bit / H, bit % H + 1 } }); });
+		state.depth = 1;
+		state.values.assign(state.ranked.size(), 0);
+		state.done.assign(state.ranked.size(), 0);
 	}
+	const int moves = (int)state.ranked.size();
+	std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() +
+		std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds));
+	std::atomic<bool> stopped(false);
 
-
-
-	void Draw()
+	for (; state.depth <= maxDepth && moves > 0; state.depth++)
 	{
-		glBindVertexArray(vao);	// make the vao and its vbos active playing the role of the data source
-		glDrawArrays(GL_TRIANGLE_FAN, 0, 6); // draw a single triangle with vertices defined in vao
+		const int depth = state.depth;
+		const bool mayStop = progress || depth > 1;
+		std::vector<JobHandle> tasks;
+		for (int m = 0; m < moves; m++)
+			if (!state.done[m])
+				tasks.push_back(pool.Submit([&, m, depth]() {
+					if (mayStop && std::chrono::steady_clock::now() >= deadline) stopped = true;
+					if (stopped) return;
+					ExpectimaxSearch<Core> search(table, samples, deadline, stopped, mayStop);
+					const BoardMove& move = state.ranked[m].move;
+					float value = search.Chance(root, move.i, move.j, move.u, move.v, depth, rootSamples);
+					if (stopped) return;
+					state.values[m] = value;
+					state.done[m] = 1;
+				}));
+		pool.Wait(tasks);
+		if (stopped) break;
+		for (int m = 0; m < moves; m++)
+		{
+			state.ranked[m].value = state.values[m];
+			state.ranked[m].depth = depth;
+			state.done[m] = 0;
+		}
+		if (std::chrono::steady_clock::now() >= deadline)
+		{
+			state.depth++;
+			break;
+		}
 	}
-};
+	ranked = state.ranked;
+	std::stable_sort(ranked.begin(), ranked.end(), [](const RankedMove& a, const RankedMove& b) { return a.value > b.value; });
+}
 
+// a board core behind virtual calls, for code that only knows the shape at run time
+class BoardKernel
+{
+public:
+	virtual ~BoardKernel() {}
+	virtual void Set(int i, int j, int ID) = 0;
+	virtual int Get(int i, int j) = 0;
+	virtual void Swap(int i, int j, int u, int v) = 0;
+	virtual bool IsLegalSwap(int i, int j, int u, int v) = 0;
+	// appends the cell index (i * height + j) of every matched cell
+	virtual void FindMatches(std::vector<int>& cells) = 0;
+	// appends every legal swap
+	virtual void FindLegalMoves(std::vector<BoardMove>& moves) = 0;
+	virtual int CountLegalMoves() = 0;
+	virtual bool HasLegalMoves() = 0;
+	virtual bool Hint(BoardMove& move) = 0;
+	virtual void Seed(const Random& random) = 0;
+	virtual Random getRandom() = 0;
+	// resolved moves, see BoardCore::Play, ClearAndResolve and Resolve
+	virtual CascadeReport Play(int i, int j, int u, int v, std::vector<CascadeEvent>* events) = 0;
+	virtual CascadeReport ClearAndResolve(const std::vector<int>& cells, std::vector<CascadeEvent>* events) = 0;
+	virtual CascadeReport Resolve(std::vector<CascadeEvent>* events) = 0;
+	// see BoardCore::Generate and BoardCore::Shuffle
+	virtual bool Generate() = 0;
+	virtual bool Shuffle(std::vector<int>& source) = 0;
+	// see AdviseMoves
+	virtual void Advise(JobSystem& pool, double seconds, Random& random, std::vector<RankedMove>& ranked) = 0;
+	// see BoardCore::CanonicalKey
+	virtual unsigned long long CanonicalKey(bool& mirrored) = 0;
+	// see SearchMoves
+	virtual void Search(JobSystem& pool, TranspositionTable& table, double seconds, std::vector<RankedMove>& ranked,
+		SearchProgress* progress) = 0;
+	virtual bool isSpecialized() = 0;
+};
 
-class Stellar : public Geometry
+template<class Core>
+class BoardKernelOf : public BoardKernel
 {
-	unsigned int vbo;
+	Core core;
 
 public:
-	Stellar()
-	{
-		glBindVertexArray(vao);
+	BoardKernelOf(const Core& core) : core(core) {}
 
-		glGenBuffers(1, &vbo);
+	Core& getCore() { return core; }
 
-		glBindBuffer(GL_ARRAY_BUFFER, vbo);
-		static float vertexCoords[24];
-		float r = .75; 
-		vertexCoords[0] = 0;
-		vertexCoords[1] = 0;
-		float A = M_PI / 2;
-		for (int i = 1; i < 13; i++)
-		{
-			if (i % 2 == 0)
-			{
-				r = (sin(M_PI / 10) / sin(3 * M_PI / 10)) * .75;
-			}
-			vertexCoords[i* 2] = cos(A) * r;
-			vertexCoords[i*2 + 1] = sin(A) * r;
-			A += M_PI / 5;
-			r = .75;
-		}
+	void Set(int i, int j, int ID) { core.Set(i, j, ID); }
+	int Get(int i, int j) { return core.Get(i, j); }
+	void Swap(int i, int j, int u, int v) { core.Swap(i, j, u, v); }
+	bool IsLegalSwap(int i, int j, int u, int v) { return core.IsLegalSwap(i, j, u, v); }
+	void FindMatches(std::vector<int>& cells) {
+		core.Matches().ForEach([&](int bit) { cells.push_back(bit); });
+	}
+	void FindLegalMoves(std::vector<BoardMove>& moves) {
+		core.RefreshMoves();
+		const int H = core.Height();
+		core.getMovesRight().ForEach([&](int bit) { moves.push_back(BoardMove{ bit / H, bit % H, bit / H + 1, bit % H }); });
+		core.getMovesUp().ForEach([&](int bit) { moves.push_back(BoardMove{ bit / H, bit % H, bit / H, bit % H + 1 }); });
+	}
+	int CountLegalMoves() { return core.CountLegalMoves(); }
+	bool HasLegalMoves() { return core.HasLegalMoves(); }
+	bool Hint(BoardMove& move) { return core.Hint(move.i, move.j, move.u, move.v); }
+	CascadeReport Play(int i, int j, int u, int v, std::vector<CascadeEvent>* events) {
+		return core.Play(i, j, u, v, events);
+	}
+	CascadeReport ClearAndResolve(const std::vector<int>& cells, std::vector<CascadeEvent>* events) {
+		typename Core::BitsType cleared(core.Cells());
+		for (int k = 0; k < cells.size(); k++) cleared.Set(cells[k]);
+		return core.ClearAndResolve(cleared, events);
+	}
+	CascadeReport Resolve(std::vector<CascadeEvent>* events) { return core.Resolve(events); }
+	void Seed(const Random& random) { core.Seed(random); }
+	Random getRandom() { return core.getRandom(); }
+	bool Generate() { return core.Generate(); }
+	bool Shuffle(std::vector<int>& source) { return core.Shuffle(source); }
+	void Advise(JobSystem& pool, double seconds, Random& random, std::vector<RankedMove>& ranked) {
+		AdviseMoves(core, pool, seconds, random, ranked);
+	}
+	unsigned long long CanonicalKey(bool& mirrored) { return core.CanonicalKey(mirrored); }
+	void Search(JobSystem& pool, TranspositionTable& table, double seconds, std::vector<RankedMove>& ranked,
+		SearchProgress* progress) {
+		SearchMoves(core, pool, table, seconds, ranked, progress);
+	}
+	bool isSpecialized() { return !std::is_same<Core, GenericBoard>::value; }
+};
 
+BoardKernel* CreateBoardKernel(int width, int height, int colors)
+{
+	BoardKernel* kernel = 0;
+	WithBoardType(width, height, colors, [&](const auto& core) {
+		kernel = new BoardKernelOf<typename std::decay<decltype(core)>::type>(core);
+	});
+	return kernel;
+}
 
+// how a simulated player picks its swap: any legal one, the one with the most
+// points right away, or the one Monte Carlo rollouts rate best
+enum SimulationPolicy { POLICY_RANDOM = 0, POLICY_GREEDY, POLICY_ADVISOR, POLICY_COUNT };
 
-		glBufferData(GL_ARRAY_BUFFER,	// copy to the GPU
-			sizeof(vertexCoords),	// size of the vbo in bytes
-			vertexCoords,		// address of the data array on the CPU
-			GL_STATIC_DRAW);	// copy to that part of the memory which is not modified
+const char* policyNames[POLICY_COUNT] = { "random", "greedy", "advisor" };
 
-								// map Attribute Array 0 to the currently bound vertex buffer (vbo)
-		glEnableVertexAttribArray(0);
+// a batch of headless games: each deals a board and plays moves swaps, the game
+// is won if it reaches target points
+struct SimulationConfig
+{
+	int width, height, colors;
+	long long games;
+	SimulationPolicy policy;
+	int moves = 20;
+	int target = 2000;
+	int rollouts = 16;		// per swap, for the advisor
+	int rolloutDepth = 3;
+};
 
-		// data organization of Attribute Array 0
-		glVertexAttribPointer(0,	// Attribute Array 0
-			2, GL_FLOAT,		// components/attribute, component type
-			GL_FALSE,		// not in fixed point format, do not normalized
-			0, NULL);		// stride and offset: it is tightly packed
+// totals and histograms of simulated games; one per worker, merged at the end
+struct SimulationStats
+{
+	static const int scoreBuckets = 20, chainBuckets = 10;
+
+	long long games = 0, wins = 0, moves = 0, shuffles = 0, points = 0;
+	long long scores[scoreBuckets] = {};	// games by final score, target / 10 points a bucket, the last one open
+	long long chains[chainBuckets] = {};	// games by longest chain, from 1, the last one open
+
+	void Add(const SimulationConfig& config, long long score, int longestChain, int played) {
+		games++;
+		wins += score >= config.target;
+		moves += played;
+		points += score;
+		int bucket = (int)(score * 10 / (config.target > 0 ? config.target : 1));
+		scores[bucket < scoreBuckets ? bucket : scoreBuckets - 1]++;
+		int chain = longestChain < 1 ? 0 : longestChain - 1;
+		chains[chain < chainBuckets ? chain : chainBuckets - 1]++;
 	}
 
+	void Merge(const SimulationStats& other) {
+		games += other.games;
+		wins += other.wins;
+		moves += other.moves;
+		shuffles += other.shuffles;
+		points += other.points;
+		for (int k = 0; k < scoreBuckets; k++) scores[k] += other.scores[k];
+		for (int k = 0; k < chainBuckets; k++) chains[k] += other.chains[k];
+	}
 
+	static void PrintBar(const char* label, long long count, long long most) {
+		char bar[41];
+		int n = most ? (int)(count * 40 / most) : 0;
+		for (int k = 0; k < n; k++) bar[k] = '#';
+		bar[n] = 0;
+		printf("%16s %10lld %s\n", label, count, bar);
+	}
 
-	void Draw()
-	{
-		glBindVertexArray(vao);	// make the vao and its vbos active playing the role of the data source
-		glDrawArrays(GL_TRIANGLE_FAN, 0, 12); // draw a single triangle with vertices defined in vao
-	
+	void Print(const SimulationConfig& config, double seconds) const {
+		printf("%lld games, %lld won (%.1f%%), %.1f points a game, %lld shuffles\n", games, wins,
+			games ? 100.0 * wins / games : 0.0, games ? (double)points / games : 0.0, shuffles);
+		printf("%.3f s, %.0f games/s, %.0f moves/s\n", seconds, games / seconds, moves / seconds);
+		long long most = 0;
+		for (int k = 0; k < scoreBuckets; k++) most = std::max(most, scores[k]);
+		printf("final score:\n");
+		char label[32];
+		for (int k = 0; k < scoreBuckets; k++)
+		{
+			if (k + 1 < scoreBuckets) snprintf(label, sizeof label, "%lld-%lld", (long long)config.target * k / 10, (long long)config.target * (k + 1) / 10 - 1);
+			else snprintf(label, sizeof label, "%lld+", (long long)config.target * k / 10);
+			PrintBar(label, scores[k], most);
+		}
+		most = 0;
+		for (int k = 0; k < chainBuckets; k++) most = std::max(most, chains[k]);
+		printf("longest chain:\n");
+		for (int k = 0; k < chainBuckets; k++)
+		{
+			snprintf(label, sizeof label, k + 1 < chainBuckets ? "%d" : "%d+", k + 1);
+			PrintBar(label, chains[k], most);
+		}
 	}
 };
 
-class Pentagon : public Geometry
+// everything a worker reuses from game to game and move to move, so the games
+// themselves allocate nothing once the first one has sized it
+template<class Core>
+struct SimulationArena
 {
-	unsigned int vbo;
+	Core game;
+	RolloutScratch<Core> trial;		// trial.game for the greedy policy
+	std::vector<BoardMove> moves;
+	std::vector<int> source;	// for Shuffle
 
-public:
-	Pentagon()
+	SimulationArena(const Core& shape) : game(shape), trial(shape) {}
+};
+
+// the swap the policy picks on arena.game, false if there is none
+template<class Core>
+bool ChooseMove(const SimulationConfig& config, SimulationArena<Core>& arena, Random& stream, BoardMove& move)
+{
+	Core& game = arena.game;
+	if (config.policy == POLICY_RANDOM) return game.RandomMove(stream, move.i, move.j, move.u, move.v);
+
+	const int H = game.Height();
+	arena.moves.clear();
+	game.RefreshMoves();
+	game.getMovesRight().ForEach([&](int bit) { arena.moves.push_back(BoardMove{ bit / H, bit % H, bit / H + 1, bit % H }); });
+	game.getMovesUp().ForEach([&](int bit) { arena.moves.push_back(BoardMove{ bit / H, bit % H, bit / H, bit % H + 1 }); });
+	long long best = -1;
+	for (int m = 0; m < arena.moves.size(); m++)
 	{
-		glBindVertexArray(vao);
+		const BoardMove& candidate = arena.moves[m];
+		long long value = 0;
+		if (config.policy == POLICY_GREEDY)
+		{
+			// on a copy with a stream of its own, the real refills stay unknown
+			arena.trial.game = game;
+			arena.trial.game.Seed(Random(stream.Next()));
+			value = arena.trial.game.Play(candidate.i, candidate.j, candidate.u, candidate.v).score;
+		}
+		else
+			value = Rollouts(game, candidate, config.rolloutDepth, config.rollouts, stream, arena.trial);
+		if (value > best)
+		{
+			best = value;
+			move = candidate;
+		}
+	}
+	return best >= 0;
+}
 
-		glGenBuffers(1, &vbo);
+// plays count games of config on boards shaped like shape, with stream as the
+// only source of randomness, into stats
+template<class Core>
+void SimulateGames(const Core& shape, const SimulationConfig& config, long long count, Random stream, SimulationStats& stats)
+{
+	SimulationArena<Core> arena(shape);
+	Core& game = arena.game;
+	for (long long g = 0; g < count; g++)
+	{
+		game.Seed(Random(stream.Next()));
+		game.Generate();
+		long long score = 0;
+		int longestChain = 0, played = 0;
+		for (; played < config.moves; played++)
+		{
+			if (!game.HasLegalMoves())
+			{
+				stats.shuffles++;
+				if (!game.Shuffle(arena.source)) game.Generate();
+			}
+			BoardMove move;
+			if (!ChooseMove(config, arena, stream, move)) break;
+			CascadeReport report = game.Play(move.i, move.j, move.u, move.v);
+			score += report.score;
+			longestChain = std::max(longestChain, report.chain);
+		}
+		stats.Add(config, score, longestChain, played);
+	}
+}
 
-		glBindBuffer(GL_ARRAY_BUFFER, vbo);
-		static float vertexCoords[14];
-		vertexCoords[0] = 0;
-		vertexCoords[1] = 0;
-		float A = M_PI / 2;
-		for (int i = 1; i < 7; i++)
+// runs the games of config spread over the workers of pool, each worker with a
+// stream split off seed and stats of its own, and prints the merged results.
+// Nothing here touches GL or the scene.
+void RunSimulation(const SimulationConfig& config, JobSystem& pool, unsigned long long seed)
+{
+	const int workers = pool.getWorkerCount();
+	std::vector<SimulationStats> stats(workers);
+	Random random(seed);
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	WithBoardType(config.width, config.height, config.colors, [&](const auto& shape) {
+		std::vector<JobHandle> tasks;
+		for (int w = 0; w < workers; w++)
 		{
-			vertexCoords[i * 2] = cos(A) * 0.75;
-			vertexCoords[i * 2 + 1] = sin(A) * 0.75;
-			A += 2 * M_PI / 5;
+			long long count = config.games / workers + (w < config.games % workers);
+			Random stream = random.Split();
+			tasks.push_back(pool.Submit([&, w, count, stream]() { SimulateGames(shape, config, count, stream, stats[w]); }));
 		}
-		// vertices in a pentagon
-		glBufferData(GL_ARRAY_BUFFER,	// copy to the GPU
-			sizeof(vertexCoords),	// size of the vbo in bytes
-			vertexCoords,		// address of the data array on the CPU
-			GL_STATIC_DRAW);	// copy to that part of the memory which is not modified
+		pool.Wait(tasks);
+	});
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	for (int w = 1; w < workers; w++) stats[0].Merge(stats[w]);
+	printf("%lld %s games on %dx%d boards with %d gem types, %d moves each, target %d, %d threads, %s lanes\n", config.games,
+		policyNames[config.policy], config.width, config.height, config.colors, config.moves, config.target, workers, laneSetNames[laneSet]);
+	stats[0].Print(config, seconds);
+}
 
-								// map Attribute Array 0 to the currently bound vertex buffer (vbo)
-		glEnableVertexAttribArray(0);
+// how Scene::Draw submits the board
+enum RenderMode { RENDER_OBJECTS = 0, RENDER_PROCEDURAL, RENDER_TEXTURE, RENDER_CHUNKS, RENDER_MODE_COUNT };
 
-		// data organization of Attribute Array 0
-		glVertexAttribPointer(0,	// Attribute Array 0
-			2, GL_FLOAT,		// components/attribute, component type
-			GL_FALSE,		// not in fixed point format, do not normalized
-			0, NULL);		// stride and offset: it is tightly packed
-	}
+const char* renderModeNames[RENDER_MODE_COUNT] = { "objects", "procedural", "texture", "chunks" };
 
-	void Draw()
-	{
-		glBindVertexArray(vao);	// make the vao and its vbos active playing the role of the data source
-		glDrawArrays(GL_TRIANGLE_FAN, 0, 7); // 
+// what the renderer needs of one cell
+struct CellSnapshot
+{
+	int ID;
+	float x, y, scale, orientation;
+
+	bool operator==(const CellSnapshot& other) const {
+		return ID == other.ID && x == other.x && y == other.y && scale == other.scale && orientation == other.orientation;
 	}
 };
 
-class Hexagon : public Geometry
+// the drawable state of the board after one simulation tick, left alone once published.
+// changed lists the cells that may differ from the last snapshot the renderer applied;
+// everything stands for all cells once that list would be too long to be worth it.
+struct SceneSnapshot
 {
-	unsigned int vbo;
+	std::vector<CellSnapshot> cells;	// column-major, see BoardLayout::Index
+	std::vector<int> changed;
+	bool everything;
+	long long tick;
 
-public:
-	Hexagon()
-	{
-		glBindVertexArray(vao);
+	SceneSnapshot() : everything(true), tick(-1) {}
+};
 
-		glGenBuffers(1, &vbo);
+// three copies of T between one writer and one reader, and neither ever waits.
+// The writer fills the back copy and trades it for the middle one; the reader
+// trades its front copy for the middle one whenever that is newer.
+template<class T>
+class TripleBuffer
+{
+	static const int fresh = 4;		// set in middle by Publish, cleared by Latest
 
-		glBindBuffer(GL_ARRAY_BUFFER, vbo);
-		static float vertexCoords[16];
-		vertexCoords[0] = 0;
-		vertexCoords[1] = 0;
-		float A = M_PI / 2;
-		for (int i = 1; i < 8; i++)
-		{
-			vertexCoords[i * 2] = cos(A) * 0.75;
-			vertexCoords[i * 2 + 1] = sin(A) * 0.75;
-			A += M_PI / 3;
-		}
-		glBufferData(GL_ARRAY_BUFFER,	// copy to the GPU
-			sizeof(vertexCoords),	// size of the vbo in bytes
-			vertexCoords,		// address of the data array on the CPU
-			GL_STATIC_DRAW);	// copy to that part of the memory which is not modified
+	T slots[3];
+	std::atomic<int> middle;
+	int back, front;
 
-								// map Attribute Array 0 to the currently bound vertex buffer (vbo)
-		glEnableVertexAttribArray(0);
+public:
+	TripleBuffer() : middle(1), back(0), front(2) {}
+
+	// the copy the writer fills next
+	T& Back() {
+		return slots[back];
+	}
 
-		// data organization of Attribute Array 0
-		glVertexAttribPointer(0,	// Attribute Array 0
-			2, GL_FLOAT,		// components/attribute, component type
-			GL_FALSE,		// not in fixed point format, do not normalized
-			0, NULL);		// stride and offset: it is tightly packed
+	void Publish() {
+		back = middle.exchange(back | fresh, std::memory_order_acq_rel) & 3;
 	}
 
+	// the newest published copy, it stays put until the next call
+	const T& Latest() {
+		if (middle.load(std::memory_order_relaxed) & fresh) front = middle.exchange(front, std::memory_order_acq_rel) & 3;
+		return slots[front];
+	}
+};
 
+// a key or mouse button going down or up, stamped when GLUT reported it
+enum InputType { INPUT_KEY_DOWN, INPUT_KEY_UP, INPUT_MOUSE_DOWN, INPUT_MOUSE_UP };
 
-	void Draw()
-	{
-		glBindVertexArray(vao);	// make the vao and its vbos active playing the role of the data source
-		glDrawArrays(GL_TRIANGLE_FAN, 0, 8); // draw a single triangle with vertices defined in vao
-	}
+struct InputEvent
+{
+	InputType type;
+	unsigned char key;
+	int i, j;		// the cell under the mouse
+	double time;	// seconds since the scene was made
+	long long tick;	// the tick that read it
 };
 
-class Heart : public Geometry
+// a ring of N items from one producer thread to one consumer thread; neither
+// ever waits, Push fails if the ring is full and Pop if it is empty
+template<class T, int N>
+class SpscQueue
 {
-	unsigned int vbo;
+	static_assert((N & (N - 1)) == 0, "the size must be a power of two");
 
-public:
-	Heart()
-	{
-		glBindVertexArray(vao);
+	T items[N];
+	std::atomic<unsigned> head;		// next to pop, written by the consumer
+	char apart[64];					// keeps head and tail off each other's cache line
+	std::atomic<unsigned> tail;		// next to push, written by the producer
 
-		glGenBuffers(1, &vbo);
+public:
+	SpscQueue() : head(0), tail(0) {}
+
+	bool Push(const T& item) {
+		unsigned next = tail.load(std::memory_order_relaxed);
+		if (next - head.load(std::memory_order_acquire) == N) return false;
+		items[next & (N - 1)] = item;
+		tail.store(next + 1, std::memory_order_release);
+		return true;
+	}
 
-		glBindBuffer(GL_ARRAY_BUFFER, vbo);
-		static float vertexCoords[104];
-		float triangle_num = 50;
-		int i;
-		int index = 0;
-		vertexCoords[0] = 0;
-		vertexCoords[1] = 0;
-		int r = 0.75;
-		index += 2;
-		for (i = 2; i < 53; i++) {
-
-			vertexCoords[index] = (16 * pow(sin((2 * i * M_PI) / triangle_num), 3)) / 24;
-			vertexCoords[index + 1] = (13 * cos((2 * i * M_PI) / triangle_num) - 5 * cos(2 * (2 * i * M_PI) / triangle_num)
-				- 2 * cos(3 * (2 * i * M_PI) / triangle_num) - cos(4 * (2 * i * M_PI) / triangle_num)) / 24;
-			index += 2;
-		}
-		glBufferData(GL_ARRAY_BUFFER,	// copy to the GPU
-			sizeof(vertexCoords),	// size of the vbo in bytes
-			vertexCoords,		// address of the data array on the CPU
-			GL_STATIC_DRAW);	// copy to that part of the memory which is not modified
+	bool Pop(T& item) {
+		unsigned first = head.load(std::memory_order_relaxed);
+		if (first == tail.load(std::memory_order_acquire)) return false;
+		item = items[first & (N - 1)];
+		head.store(first + 1, std::memory_order_release);
+		return true;
+	}
+};
 
-								// map Attribute Array 0 to the currently bound vertex buffer (vbo)
-		glEnableVertexAttribArray(0);
+// background work done a slice at a time in the spare time of frames. slice works
+// until the time it is given and returns true once the task is done; dropped is
+// called if the task misses its deadline or overruns a slice, a cancelled task is
+// just let go.
+struct BackgroundTask
+{
+	const char* name;
+	std::chrono::steady_clock::time_point deadline;
+	std::function<bool(std::chrono::steady_clock::time_point)> slice;
+	std::function<void()> dropped;
+	bool cancelled;
+};
 
-		// data organization of Attribute Array 0
-		glVertexAttribPointer(0,	// Attribute Array 0
-			2, GL_FLOAT,		// components/attribute, component type
-			GL_FALSE,		// not in fixed point format, do not normalized
-			0, NULL);		// stride and offset: it is tightly packed
+// hands what is left of every tick to the background tasks. The simulation
+// thread runs them after its update, until the end of the tick or the start of
+// the next frame the GLUT thread is expected to draw, whichever comes first, less
+// a margin. A draw under way or about to start is waited out, so the tasks never
+// take the CPU from a frame. The time is shared among the tasks, and a task is not
+// started on less than a minimum slice. Tasks that went without wait at the front
+// of the next tick; a task that overruns its slice is dropped.
+class FrameScheduler
+{
+	typedef std::chrono::steady_clock Clock;
+	static const int marginMicroseconds = 1500;
+	static const int minimumSliceMicroseconds = 1000;
+
+	std::vector<std::shared_ptr<BackgroundTask> > tasks;
+
+	// the frames as measured on the GLUT thread, in steady clock ticks; each is
+	// read on its own, a torn set only makes one estimate a frame old
+	std::atomic<Clock::rep> drawStart, drawLength, framePeriod;
+
+	// the start of the next frame that may need the CPU after now: the one being
+	// drawn if it is not done yet, else the next one due. Clock::time_point::max()
+	// if nothing has been drawn lately.
+	Clock::time_point NextDraw(Clock::time_point now) {
+		Clock::duration period(framePeriod.load(std::memory_order_relaxed));
+		Clock::duration length(drawLength.load(std::memory_order_relaxed));
+		Clock::time_point start(Clock::duration(drawStart.load(std::memory_order_relaxed)));
+		if (period <= Clock::duration::zero() || now - start > 4 * period) return Clock::time_point::max();
+		while (start + length <= now) start += period;
+		return start;
 	}
 
+public:
+	FrameScheduler() : drawStart(0), drawLength(0), framePeriod(0) {}
+
+	// everything a task touches belongs to the thread that calls Run
+	std::shared_ptr<BackgroundTask> Add(const char* name, double seconds, std::function<bool(Clock::time_point)> slice,
+		std::function<void()> dropped = nullptr) {
+		std::shared_ptr<BackgroundTask> task(new BackgroundTask{ name, Clock::now() +
+			std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(seconds)), slice, dropped, false });
+		tasks.push_back(task);
+		return task;
+	}
 
+	// called on the GLUT thread for every frame it drew between start and end
+	void Drew(Clock::time_point start, Clock::time_point end) {
+		Clock::time_point last(Clock::duration(drawStart.load(std::memory_order_relaxed)));
+		Clock::duration period(framePeriod.load(std::memory_order_relaxed)), since = start - last;
+		// a draw is better expected too early than too late: a frame that came
+		// early is believed at once, a late one moves the estimate by an eighth
+		if (last == Clock::time_point()) period = Clock::duration::zero();
+		else if (period == Clock::duration::zero() || since < period) period = since;
+		else period += (std::min(since, 4 * period) - period) / 8;
+		framePeriod.store(period.count(), std::memory_order_relaxed);
+		drawLength.store((end - start).count(), std::memory_order_relaxed);
+		drawStart.store(start.time_since_epoch().count(), std::memory_order_relaxed);
+	}
 
-	void Draw()
-	{
-		glBindVertexArray(vao);	// make the vao and its vbos active playing the role of the data source
-		glDrawArrays(GL_TRIANGLE_FAN, 0, 52); // draw a single triangle with vertices defined in vao
+	// runs the tasks in what is left of a tick that ends at end
+	void Run(Clock::time_point end) {
+		const std::chrono::microseconds margin(marginMicroseconds), minimum(minimumSliceMicroseconds);
+		Clock::time_point now = Clock::now(), draw = NextDraw(now);
+		if (draw - now < minimum + margin)
+		{
+			// take the time after the draw instead, if the tick lasts that long
+			Clock::time_point drawn = draw + Clock::duration(drawLength.load(std::memory_order_relaxed));
+			if (drawn + minimum + margin >= end) return;
+			std::this_thread::sleep_until(drawn);
+			now = Clock::now();
+			draw = NextDraw(now);
+		}
+		Clock::time_point until = std::min(end, draw) - margin;
+		std::vector<std::shared_ptr<BackgroundTask> > queue, starved, served;
+		queue.swap(tasks);
+		for (int k = 0; k < queue.size(); k++)
+		{
+			BackgroundTask& task = *queue[k];
+			now = Clock::now();
+			if (task.cancelled || now >= task.deadline)
+			{
+				if (task.dropped && !task.cancelled) task.dropped();
+				continue;
+			}
+			Clock::duration share = (until - now) / (int)(queue.size() - k);
+			if (share < minimum)
+			{
+				starved.push_back(queue[k]);
+				continue;
+			}
+			Clock::time_point stop = now + share;
+			bool done = task.slice(stop);
+			Clock::duration over = Clock::now() - stop;
+			if (over > margin)
+			{
+				printf("background %s ran %.1f ms past its slice\n", task.name, std::chrono::duration<double, std::milli>(over).count());
+				if (!done && task.dropped && !task.cancelled) task.dropped();
+				continue;
+			}
+			if (!done) served.push_back(queue[k]);
+		}
+		// tasks added by a slice come last
+		starved.insert(starved.end(), served.begin(), served.end());
+		starved.insert(starved.end(), tasks.begin(), tasks.end());
+		tasks.swap(starved);
 	}
 };
 
-# include <vector>
-Object* objectgrid[10][10];
-
 class Scene {
 	Shader* shader;
 	Shader* hShader;
+	proceduralShader* pShader;
+	ProceduralShapes* procedural;
+	textureBoardShader* tShader;
+	BoardTexture* boardTexture;
+	chunkShader* cShader;
+	Material* chunkMaterial;
+	std::vector<Mesh*> chunkMeshes;
+	std::vector<BoardChunk*> chunks;
+	int chunkColumns, chunkRows;
+	static const int parallelCells = 16384;		// fewest cells worth a job of their own
+	BoardBackground* background;
+	Mesh* backgroundMesh;
+	Compositor* compositor;
+	RenderMode renderMode;
+
+	// one material, geometry and mesh per gem type, shared by every cell of that type
 	std::vector<Material*> materials;
 	std::vector<Geometry*> geometries;
 	std::vector<Mesh*> meshes;
+	std::vector<Object*> stamps;		// one object per gem type, placed for every cell it draws
+
+	// Update runs on the simulation thread and Draw on the GLUT thread, they
+	// only share the snapshots and the input queue
+	static const int tickRate = 60;		// updates a second
+	TripleBuffer<SceneSnapshot> snapshots;
+	std::vector<CellSnapshot> published;		// the cells as of the last Publish
+	std::vector<std::vector<int>> columnChanges;	// cells Publish found changed, by column
+	std::deque<std::pair<long long, std::vector<int>>> unseen;	// changes by tick, until the renderer has them
+	size_t unseenCells;
+	long long everythingUntil;		// snapshots list every cell until the renderer is past this tick
+	std::atomic<long long> textureTick;		// the snapshot boardTexture was last brought up to
+	std::thread simulation;
+	std::atomic<bool> running;
+	long long ticks;
+
+	SpscQueue<InputEvent, 256> input;		// posted by the GLUT callbacks, read once a tick
+	std::chrono::steady_clock::time_point epoch;
+	bool held[256];		// keys down, as far as the simulation has read
+
+	// the AI and the replay writer only get what a tick and the frames leave over, see Start
+	FrameScheduler spare;
+	std::shared_ptr<BackgroundTask> aiTask;		// the advice or search in progress
+
+	struct ReplayRecording
+	{
+		std::ofstream file;
+		std::vector<unsigned char> cells;	// the board at the start, column-major
+		int columns;	// columns of cells in the file so far
+		std::deque<InputEvent> events;	// read while recording, not yet in the file
+		int written;	// events in the file so far
+		bool stopping;
+	};
+	std::shared_ptr<ReplayRecording> recording;
+	unsigned long long seed;
+
+	BoardLayout layout;
+	std::vector<Object*> objectgrid;	// column-major, see BoardLayout::Index
+	BoardKernel* board;					// the settled board; objectgrid lags behind while a replay runs
+	int score;
+
+	// the events of the last resolved move, replayed one link at a time:
+	// the cleared gems shrink, then the gems fall and the new ones drop in
+	enum ReplayPhase { REPLAY_IDLE, REPLAY_CLEARING, REPLAY_FALLING };
+	std::vector<CascadeEvent> events;
+	int nextEvent, link;
+	ReplayPhase phase;
+	CascadeReport pending;				// reported when the replay ends
+
+	Random random;		// the session stream, board cores get streams split off it
+	Random aiRandom;	// the AI's own stream, so asking for advice leaves the session as it was
+	TranspositionTable* table;	// search values, they stay valid from move to move
+	AnalysisCache* analysis;	// the best swap of every board searched so far
 
 	int currentI;
 	int currentJ;
@@ -944,107 +4710,156 @@ class Scene {
 	int futureI;
 	int futureJ;
 
+	Object*& Cell(int i, int j) {
+		return objectgrid[i * layout.height + j];
+	}
+
+	Shader* ShaderOf(int ID) {
+		return gemShapes[ID].curve == CURVE_HEART ? hShader : shader;
+	}
+
+	int RandomType() {
+		return random.Below(layout.gemTypes) + 1;
+	}
+
+	// turns the object of cell (i, j) into a fresh gem of the given type, without reallocating it
+	void Respawn(int i, int j, int ID) {
+		Cell(i, j)->Reset(ShaderOf(ID), meshes[ID - 1], layout.CellPosition(i, j),
+			vec2(layout.GemScale(), layout.GemScale()), ID);
+		board->Set(i, j, ID);
+	}
+
 public:
-	Scene() { 
+	Scene(int width, int height, int gemTypes, unsigned long long seed) : layout(width, height, gemTypes), random(seed), aiRandom(random.Split()) {
 		
 		shader = 0; 
 		hShader = 0; 
+		pShader = 0;
+		procedural = 0;
+		tShader = 0;
+		boardTexture = 0;
+		cShader = 0;
+		chunkMaterial = 0;
+		chunkColumns = chunkRows = 0;
+		background = 0;
+		backgroundMesh = 0;
+		compositor = 0;
+		board = 0;
+		table = 0;
+		analysis = 0;
+		score = 0;
+		ticks = 0;
+		unseenCells = 0;
+		everythingUntil = -1;
+		textureTick = -1;
+		running = false;
+		this->seed = seed;
+		epoch = std::chrono::steady_clock::now();
+		for (int k = 0; k < 256; k++) held[k] = false;
+		nextEvent = link = 0;
+		phase = REPLAY_IDLE;
+		// large boards would cost a draw call per cell
+		renderMode = width * height > 100 * 100 ? RENDER_TEXTURE : RENDER_OBJECTS;
+		currentI = currentJ = 0;
 	}
 	void Initialize() {
 		shader = new normalShader();
 		hShader = new heartShader();
+		pShader = new proceduralShader();
+		procedural = new ProceduralShapes();
+		tShader = new textureBoardShader();
+		tShader->UploadLayout(layout.width, layout.height, layout.origin, layout.cellSize, layout.GemOffset(), layout.GemScale());
+		boardTexture = new BoardTexture(layout.width, layout.height, layout.GemScale());
+
+		cShader = new chunkShader();
+		chunkMaterial = new Material(cShader, vec4(1, 1, 1));
+		chunkColumns = (layout.width + BoardChunk::size - 1) / BoardChunk::size;
+		chunkRows = (layout.height + BoardChunk::size - 1) / BoardChunk::size;
+		for (int k = 0; k < chunkColumns * chunkRows; k++)
+		{
+			chunks.push_back(new BoardChunk());
+			chunkMeshes.push_back(new Mesh(chunks[k], chunkMaterial));
+		}
+
+		background = new BoardBackground(layout.width, layout.height, layout.origin, layout.cellSize, layout.GemOffset());
+		backgroundMesh = new Mesh(background, chunkMaterial);
+		compositor = new Compositor(cShader, windowWidth, windowHeight);
+		compositor->AddStaticLayer(backgroundMesh);
 	
 		// build the scene here
-		//materials.push_back(new Material(shader, vec4(1, 0, 0)));
-		//materials.push_back(new Material(shader, vec4(0, 1, 0)));
-		//materials.push_back(new Material(shader, vec4(0, 0, 1)));
-		//materials.push_back(new Material(shader, vec4(0, 1, 1)));
-		//materials.push_back(new Material(shader, vec4(1, 1, 1)));
-		//materials.push_back(new Material(hShader, vec4(0.5, 0, 1)));
-
-
-		//geometries.push_back(new Triangle());
-		//geometries.push_back(new Quad());
-		//geometries.push_back(new Stellar()); 
-		//geometries.push_back(new Pentagon());
-		//geometries.push_back(new Hexagon());
-		//geometries.push_back(new Heart());
-
-		//meshes.push_back(new Mesh(geometries[0], materials[0]));
-		//meshes.push_back(new Mesh(geometries[1], materials[1]));
-		//meshes.push_back(new Mesh(geometries[2], materials[2]));
-		//meshes.push_back(new Mesh(geometries[3], materials[3]));
-		//meshes.push_back(new Mesh(geometries[4], materials[4]));
-		//meshes.push_back(new Mesh(geometries[5], materials[5]));
-
-		/*objects.push_back(new Object(shader, meshes[0], vec2(-0.5, -0.5), vec2(0.5, 1.0), 10.0));
-		objects.push_back(new Object(shader, meshes[1], vec2(0.25, 0.5), vec2(0.5, 0.5), -30.0));*/
-
-		for (int i = 0; i < 10; i++)
-			for (int j = 0; j < 10; j++)
+		geometries.push_back(new Triangle());
+		geometries.push_back(new Quad());
+		geometries.push_back(new Stellar());
+		geometries.push_back(new Pentagon());
+		geometries.push_back(new Hexagon());
+		geometries.push_back(new Heart());
+
+		for (int ID = 1; ID < gemShapeCount; ID++)
+		{
+			materials.push_back(new Material(ShaderOf(ID), gemShapes[ID].color));
+			meshes.push_back(new Mesh(geometries[ID - 1], materials[ID - 1]));
+			stamps.push_back(new Object(ShaderOf(ID), meshes[ID - 1], vec2(0, 0), vec2(1, 1), 0.0, ID));
+		}
+
+		// a board that does not clear itself on the first frame and has a move
+		board = CreateBoardKernel(layout.width, layout.height, layout.gemTypes);
+		board->Seed(random.Split());
+		table = new TranspositionTable(20);
+		analysis = new AnalysisCache(16);
+		if (!board->Generate())
+			for (int i = 0; i < layout.width; i++)
+				for (int j = 0; j < layout.height; j++)
+					board->Set(i, j, RandomType());
+
+		objectgrid.resize(layout.width * layout.height);
+		for (int i = 0; i < layout.width; i++)
+			for (int j = 0; j < layout.height; j++)
 			{
-				int r = (rand() % 6) + 1;
-				switch (r)
-				{
-				case 1: 
-					materials.push_back(new Material(shader, vec4(1, 0.5, 0)));
-					geometries.push_back(new Triangle());
-					meshes.push_back(new Mesh(geometries[(i*10) + j], materials[(i*10) + j]));
-					objectgrid[i][j] = new Object(shader, meshes[(i * 10) + j],
-						vec2((((float)(i - 5)) / 5) + 0.08, (((float)(j - 5)) / 5) + 0.08), vec2(0.1, 0.1), 0.0, 1);
-					break;
-				case 2: 
-					materials.push_back(new Material(shader, vec4(0.3, 1, 0)));
-					geometries.push_back(new Quad());
-					meshes.push_back(new Mesh(geometries[(i * 10) + j], materials[(i * 10) + j]));
-					objectgrid[i][j] = new Object(shader, meshes[(i * 10) + j],
-						vec2((((float)(i - 5)) / 5) + 0.08, (((float)(j - 5)) / 5) + 0.08), vec2(0.1, 0.1), 0.0, 2);
-					break;
-				case 3: 
-					materials.push_back(new Material(shader, vec4(0.6, 0, 1)));
-					geometries.push_back(new Stellar());
-					meshes.push_back(new Mesh(geometries[(i * 10) + j], materials[(i * 10) + j]));
-					objectgrid[i][j] = new Object(shader, meshes[(i * 10) + j],
-						vec2((((float)(i - 5)) / 5) + 0.08, (((float)(j - 5)) / 5) + 0.08), vec2(0.1, 0.1), 0.0, 3);
-					break;
-				case 4:
-					materials.push_back(new Material(shader, vec4(0.54, 1, 1)));
-					geometries.push_back(new Pentagon());
-					meshes.push_back(new Mesh(geometries[(i * 10) + j], materials[(i * 10) + j]));
-					objectgrid[i][j] = new Object(shader, meshes[(i * 10) + j],
-						vec2((((float)(i - 5)) / 5) + 0.08, (((float)(j - 5)) / 5) + 0.08), vec2(0.1, 0.1), 0.0, 4);
-					break;
-				case 5:
-					materials.push_back(new Material(shader, vec4(1, 1, 1)));
-					geometries.push_back(new Hexagon());
-					meshes.push_back(new Mesh(geometries[(i * 10) + j], materials[(i * 10) + j]));
-					objectgrid[i][j] = new Object(shader, meshes[(i * 10) + j],
-						vec2((((float)(i - 5)) / 5) + 0.08, (((float)(j - 5)) / 5) + 0.08), vec2(0.1, 0.1), 0.0, 5);
-					break;
-				case 6:
-					materials.push_back(new Material(hShader, vec4(0.5, 0, 1)));
-					geometries.push_back(new Heart());
-					meshes.push_back(new Mesh(geometries[(i * 10) + j], materials[(i * 10) + j]));
-					objectgrid[i][j] = new Object(hShader, meshes[(i * 10) + j],
-						vec2((((float)(i - 5)) / 5) + 0.08, (((float)(j - 5)) / 5) + 0.08), vec2(0.1, 0.1), 0.0, 6);
-				}
-				/*objectgrid[i][j] = new Object(shader, meshes[(i * 10) + j], 
-					vec2((((float)(i - 5)) / 5) + 0.08, (((float)(j - 5)) / 5) + 0.08), vec2(0.1, 0.1), 0.0);*/
+				int ID = board->Get(i, j);
+				Cell(i, j) = new Object(ShaderOf(ID), meshes[ID - 1], layout.CellPosition(i, j),
+					vec2(layout.GemScale(), layout.GemScale()), 0.0, ID);
 			}
 
+		Publish();
+
+		printf("board %dx%d, %d gem types, %s core, render mode: %s\n", layout.width, layout.height, layout.gemTypes,
+			board->isSpecialized() ? "specialized" : "generic", renderModeNames[renderMode]);
 		shader->Run();
 	}
 	~Scene() {
+		Stop();
 		for (int i = 0; i < materials.size(); i++) delete materials[i];
+		for (int i = 0; i < stamps.size(); i++) delete stamps[i];
 		for (int i = 0; i < geometries.size(); i++) delete geometries[i];
 		for (int i = 0; i < meshes.size(); i++) delete meshes[i];
-		//for (int i = 0; i < objects.size(); i++) delete objects[i];
-		for (int i = 0; i < 10; i++)
-			for (int j = 0; j < 10; j++)
-			{
-				delete objectgrid[i][j];
-			}
+		for (int i = 0; i < objectgrid.size(); i++) delete objectgrid[i];
+		if (board) delete board;
+		if (table) delete table;
+		if (analysis) delete analysis;
 		if (shader) delete shader;
+		if (hShader) delete hShader;
+		if (pShader) delete pShader;
+		if (procedural) delete procedural;
+		if (tShader) delete tShader;
+		if (boardTexture) delete boardTexture;
+		for (int k = 0; k < chunks.size(); k++) delete chunks[k];
+		for (int k = 0; k < chunkMeshes.size(); k++) delete chunkMeshes[k];
+		if (compositor) delete compositor;
+		if (backgroundMesh) delete backgroundMesh;
+		if (background) delete background;
+		if (chunkMaterial) delete chunkMaterial;
+		if (cShader) delete cShader;
+	}
+
+	BoardLayout& getLayout() {
+		return layout;
+	}
+
+	// the cell under a world position, false if it is off the board
+	bool PickCell(vec2 p, int& i, int& j) {
+		i = layout.Column(p.x);
+		j = layout.Row(p.y);
+		return i >= 0 && i < layout.width && j >= 0 && j < layout.height;
 	}
 
 	void HeartBeat(double t) {
@@ -1058,201 +4873,653 @@ public:
 		//        }
 		hShader->Run();
 		hShader->UploadTime(sin(3 * t));
+		pShader->Run();
+		pShader->UploadTime(sin(3 * t));
+		tShader->Run();
+		tShader->UploadTime(sin(3 * t));
+		cShader->Run();
+		cShader->UploadTime(sin(3 * t));
 	}
 
-	void Update() {
-		for (int i = 0; i < 10; i++)
-			for (int j = 0; j < 10; j++)
+	// cells overlapping the viewport, inclusive; empty if i0 > i1 or j0 > j1
+	void VisibleCells(int& i0, int& i1, int& j0, int& j1) {
+		vec2 min, max;
+		camera.getVisibleRect(min, max);
+		i0 = layout.Column(min.x);
+		i1 = layout.Column(max.x);
+		j0 = layout.Row(min.y);
+		j1 = layout.Row(max.y);
+		if (i0 < 0) i0 = 0;
+		if (j0 < 0) j0 = 0;
+		if (i1 > layout.width - 1) i1 = layout.width - 1;
+		if (j1 > layout.height - 1) j1 = layout.height - 1;
+	}
+
+	// runs Update tickRate times a second on a thread of its own until Stop
+	void Start() {
+		running = true;
+		simulation = std::thread([this]() {
+			const std::chrono::steady_clock::duration tick = std::chrono::microseconds(1000000 / tickRate);
+			std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now();
+			while (running)
 			{
-				if (j - 1 >= 0 && j + 1 < 10)
-				{
-					if (objectgrid [i][j]->getID() == objectgrid[i][j + 1]->getID() && objectgrid[i][j]->getID() == objectgrid[i][j - 1]->getID())
-					{
-						objectgrid[i][j - 1]->DeleteBlock();
-						objectgrid[i][j]->DeleteBlock();
-						objectgrid[i][j + 1]->DeleteBlock();
+				Update();
+				// the background gets what the update left of the tick, clear of the frames
+				spare.Run(next + tick);
+				// a tick that ran long is not made up for
+				std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+				next = next + tick < now ? now : next + tick;
+				std::this_thread::sleep_until(next);
+			}
+		});
+	}
 
-					}
+	void Stop() {
+		running = false;
+		if (simulation.joinable()) simulation.join();
+	}
 
-					if (objectgrid[j][i]->getID() == objectgrid[j + 1][i]->getID() && objectgrid[j][i]->getID() == objectgrid[j - 1][i]->getID())
-					{
-						objectgrid[j - 1][i]->DeleteBlock();
-						objectgrid[j][i]->DeleteBlock();
-						objectgrid[j + 1][i]->DeleteBlock();
-					}
+	void Hint() {
+		BoardMove move;
+		if (board->Hint(move))
+			printf("hint: swap %i %i with %i %i (%i moves)\n", move.i, move.j, move.u, move.v, board->CountLegalMoves());
+		else
+			printf("no moves left\n");
+	}
 
-				}
+	// true if the board is no longer the one with the given canonical key, or is being replayed
+	bool BoardChanged(unsigned long long key) {
+		bool mirrored;
+		return phase != REPLAY_IDLE || board->CanonicalKey(mirrored) != key;
+	}
 
-				if (objectgrid[i][j]->getID() == 4)
-				{
-					objectgrid[i][j]->Rotate(0.5);
-				}
+	// seconds from now until the end of a slice, at most left
+	static double SliceSeconds(std::chrono::steady_clock::time_point until, double left) {
+		return std::min(std::chrono::duration<double>(until - std::chrono::steady_clock::now()).count(), left);
+	}
 
-				objectgrid[i][j]->CheckD();
-				if (keyboardState['b']) {
-					objectgrid[currentI][currentJ]->DeleteBlock();
-				}
-				if (objectgrid[i][j]->getScale().x < 0.02) {
-					int r = (rand() % 6) + 1;
-					switch (r)
-					{
-					case 1:
-						materials[(i * 10) + j] = new Material(shader, vec4(1, 0.5, 0));
-						geometries[(i * 10) + j] = new Triangle();
-						meshes[(i * 10) + j] = new Mesh(geometries[(i * 10) + j], materials[(i * 10) + j]);
-						objectgrid[i][j] = new Object(shader, meshes[(i * 10) + j],
-							vec2((((float)(i - 5)) / 5) + 0.08, (((float)(j - 5)) / 5) + 0.08), vec2(0.1, 0.1), 0.0, 1);
-						break;
-					case 2:
-						materials[(i * 10) + j] = new Material(shader, vec4(0.3, 1, 0));
-						geometries[(i * 10) + j] = new Quad();
-						meshes[(i * 10) + j] = new Mesh(geometries[(i * 10) + j], materials[(i * 10) + j]);
-						objectgrid[i][j] = new Object(shader, meshes[(i * 10) + j],
-							vec2((((float)(i - 5)) / 5) + 0.08, (((float)(j - 5)) / 5) + 0.08), vec2(0.1, 0.1), 0.0, 2);
-						break;
-					case 3:
-						materials[(i * 10) + j] = new Material(shader, vec4(0.6, 0, 1));
-						geometries[(i * 10) + j] = new Stellar();
-						meshes[(i * 10) + j] = new Mesh(geometries[(i * 10) + j], materials[(i * 10) + j]);
-						objectgrid[i][j] = new Object(shader, meshes[(i * 10) + j],
-							vec2((((float)(i - 5)) / 5) + 0.08, (((float)(j - 5)) / 5) + 0.08), vec2(0.1, 0.1), 0.0, 3);
-						break;
-					case 4:
-						materials[(i * 10) + j] = new Material(shader, vec4(0.54, 1, 1));
-						geometries[(i * 10) + j] = new Pentagon();
-						meshes[(i * 10) + j] = new Mesh(geometries[(i * 10) + j], materials[(i * 10) + j]);
-						objectgrid[i][j] = new Object(shader, meshes[(i * 10) + j],
-							vec2((((float)(i - 5)) / 5) + 0.08, (((float)(j - 5)) / 5) + 0.08), vec2(0.1, 0.1), 0.0, 4);
-						break;
-					case 5:
-						materials[(i * 10) + j] = new Material(shader, vec4(1, 1, 1));
-						geometries[(i * 10) + j] = new Hexagon();
-						meshes[(i * 10) + j] = new Mesh(geometries[(i * 10) + j], materials[(i * 10) + j]);
-						objectgrid[i][j] = new Object(shader, meshes[(i * 10) + j],
-							vec2((((float)(i - 5)) / 5) + 0.08, (((float)(j - 5)) / 5) + 0.08), vec2(0.1, 0.1), 0.0, 5);
-						break;
-					case 6:
-						materials[(i * 10) + j] = new Material(hShader, vec4(0.5, 0, 1));
-						geometries[(i * 10) + j] = new Heart();
-						meshes[(i * 10) + j] = new Mesh(geometries[(i * 10) + j], materials[(i * 10) + j]);
-						objectgrid[i][j] = new Object(hShader, meshes[(i * 10) + j],
-							vec2((((float)(i - 5)) / 5) + 0.08, (((float)(j - 5)) / 5) + 0.08), vec2(0.1, 0.1), 0.0, 6);
-						break;
-					}
-				}
+	// the best swaps by AdviseMoves, after a tenth of a second of rollouts spread
+	// over the spare time of frames; given up if the board changes first
+	void Advise() {
+		if (phase != REPLAY_IDLE) return;
+		if (aiTask) aiTask->cancelled = true;
+		struct Advice
+		{
+			unsigned long long key;
+			double spent;
+			std::vector<RankedMove> ranked;
+		};
+		bool mirrored;
+		std::shared_ptr<Advice> advice(new Advice{ board->CanonicalKey(mirrored), 0 });
+		aiTask = spare.Add("advice", 2, [this, advice](std::chrono::steady_clock::time_point until) {
+			if (BoardChanged(advice->key))
+			{
+				printf("advice dropped, the board changed\n");
+				return true;
 			}
-		if (keyboardState['q']) {
-			camera.Quake(sin(t * 100));
-			for (int i = 0; i < 10; i++) {
-				for (int j = 0; j < 10; j++) {
-					int ran = rand() % 5000;
-					if (ran == 1) {
-						objectgrid[i][j]->DeleteBlock();
-					}
-				}
-			 }
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			std::vector<RankedMove> ranked;
+			board->Advise(*aiJobs, SliceSeconds(until, 0.1 - advice->spent), aiRandom, ranked);
+			advice->spent += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			MergeRankedMoves(advice->ranked, ranked);
+			if (advice->spent < 0.1 && !ranked.empty()) return false;
+			if (ranked.empty()) printf("no moves left\n");
+			for (int k = 0; k < advice->ranked.size() && k < 3; k++)
+			{
+				const RankedMove& move = advice->ranked[k];
+				printf("advice %i: swap %i %i with %i %i, %.1f points (%i rollouts)\n", k + 1, move.move.i, move.move.j,
+					move.move.u, move.move.v, move.value, move.rollouts);
+			}
+			return true;
+		}, []() { printf("advice dropped, out of time\n"); });
+	}
+
+	// the best swaps by SearchMoves, after a tenth of a second of search spread
+	// over the spare time of frames, every slice going on where the last one
+	// stopped. A board searched before, mirrored or with its colors renamed, gets
+	// its cached best swap at once.
+	void Search() {
+		if (phase != REPLAY_IDLE) return;
+		if (aiTask) aiTask->cancelled = true;
+		bool mirrored;
+		unsigned long long key = board->CanonicalKey(mirrored);
+		Analysis cached;
+		if (analysis->Find(key, mirrored, layout.width, layout.height, cached))
+		{
+			printf("search: swap %i %i with %i %i, %.1f points over %i moves (cached)\n", cached.move.i, cached.move.j,
+				cached.move.u, cached.move.v, cached.value, cached.depth);
+			return;
+		}
+		struct Result
+		{
+			double spent;
+			SearchProgress progress;
+		};
+		std::shared_ptr<Result> result(new Result{ 0 });
+		aiTask = spare.Add("search", 2, [this, result, key, mirrored](std::chrono::steady_clock::time_point until) {
+			if (BoardChanged(key))
+			{
+				printf("search dropped, the board changed\n");
+				return true;
+			}
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			std::vector<RankedMove> best;
+			board->Search(*aiJobs, *table, SliceSeconds(until, 0.1 - result->spent), best, &result->progress);
+			result->spent += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			if (!best.empty() && (result->spent < 0.1 || best[0].depth == 0)) return false;
+			if (best.empty()) printf("no moves left\n");
+			else analysis->Store(key, mirrored, layout.width, layout.height, Analysis{ best[0].move, (float)best[0].value, best[0].depth });
+			for (int k = 0; k < best.size() && k < 3; k++)
+				printf("search %i: swap %i %i with %i %i, %.1f points over %i moves\n", k + 1, best[k].move.i, best[k].move.j,
+					best[k].move.u, best[k].move.v, best[k].value, best[k].depth);
+			return true;
+		}, []() { printf("search dropped, out of time\n"); });
+	}
+
+	// starts writing the session from this tick on to replayPath in the background,
+	// or has the writer finish the file and stop. The header holds everything the
+	// rest of the session follows from, taken between moves: the shape and seed,
+	// the tick, score and selection, the session and board streams, the keys down
+	// and the board, a line of IDs per column. After it comes a line per event:
+	// tick, seconds, type, key, cell. Events read later in the starting tick come
+	// before that tick's Step, like on the live run.
+	void ToggleReplay() {
+		const char* replayPath = "replay.txt";
+		if (recording)
+		{
+			recording->stopping = true;
+			recording = nullptr;
+			return;
+		}
+		if (phase != REPLAY_IDLE)
+		{
+			printf("a move is playing out, start the recording once it is done\n");
+			return;
+		}
+		std::shared_ptr<ReplayRecording> replay(new ReplayRecording());
+		replay->file.open(replayPath);
+		if (!replay->file)
+		{
+			printf("cannot write %s\n", replayPath);
+			return;
 		}
+		char line[256];
+		unsigned long long session[4], stream[4];
+		random.getState(session);
+		board->getRandom().getState(stream);
+		snprintf(line, sizeof(line), "board %d %d %d %llu\ntick %lld score %d selected %d %d\n", layout.width, layout.height, layout.gemTypes,
+			seed, ticks, score, currentI, currentJ);
+		replay->file << line;
+		snprintf(line, sizeof(line), "random %016llx %016llx %016llx %016llx\nstream %016llx %016llx %016llx %016llx\nheld",
+			session[0], session[1], session[2], session[3], stream[0], stream[1], stream[2], stream[3]);
+		replay->file << line;
+		for (int k = 0; k < 256; k++)
+			if (held[k]) replay->file << ' ' << k;
+		replay->file << '\n';
+		for (int i = 0; i < layout.width; i++)
+			for (int j = 0; j < layout.height; j++) replay->cells.push_back((unsigned char)board->Get(i, j));
+		replay->columns = 0;
+		replay->written = 0;
+		replay->stopping = false;
+		recording = replay;
+		printf("recording the session to %s\n", replayPath);
+		spare.Add("replay", 1e9, [this, replay, replayPath](std::chrono::steady_clock::time_point until) {
+			const int H = layout.height;
+			while (replay->columns < layout.width)
+			{
+				replay->file << "cells";
+				for (int j = 0; j < H; j++) replay->file << ' ' << (int)replay->cells[replay->columns * H + j];
+				replay->file << '\n';
+				replay->columns++;
+				if (std::chrono::steady_clock::now() >= until) return false;
+			}
+			std::vector<unsigned char>().swap(replay->cells);
+			char line[128];
+			while (!replay->events.empty())
+			{
+				const InputEvent& event = replay->events.front();
+				snprintf(line, sizeof(line), "%lld %.6f %d %d %d %d\n", event.tick, event.time, event.type, event.key, event.i, event.j);
+				replay->file << line;
+				replay->events.pop_front();
+				replay->written++;
+				if (std::chrono::steady_clock::now() >= until) return false;
+			}
+			if (!replay->stopping) return false;
+			replay->file.close();
+			printf("%d input events written to %s\n", replay->written, replayPath);
+			return true;
+		}, [this, replay, replayPath]() {
+			replay->file.close();
+			if (recording == replay) recording = nullptr;
+			printf("replay dropped, %d input events written to %s\n", replay->written, replayPath);
+		});
+	}
 
+	// rearranges the gems by BoardCore::Shuffle
+	void Shuffle() {
+		std::vector<int> source;
+		if (!board->Shuffle(source))
+		{
+			// these gems have no layout with a move, deal a new board
+			board->Generate();
+			for (int i = 0; i < layout.width; i++)
+				for (int j = 0; j < layout.height; j++)
+					Respawn(i, j, board->Get(i, j));
+			printf("no moves left, dealt new gems\n");
+			return;
+		}
+		std::vector<Object*> shuffled(objectgrid.size());
+		for (int k = 0; k < shuffled.size(); k++)
+		{
+			shuffled[k] = objectgrid[source[k]];
+			shuffled[k]->setPosition(layout.CellPosition(k / layout.height, k % layout.height));
+		}
+		objectgrid.swap(shuffled);
+		printf("no moves left, shuffled\n");
+	}
 
+	void NextRenderMode() {
+		renderMode = (RenderMode)((renderMode + 1) % RENDER_MODE_COUNT);
+		printf("render mode: %s\n", renderModeNames[renderMode]);
 	}
 
-	//void SetOrientation(double t) {
-	//	for (int i = 0; i < 10; i++) {
-	//		for (int j = 0; j < 10; j++) {
-	//			if (shapes[i][j] == 3) {
-	//				objects[i][j]->SetOrientation(t);
-	//			}
-	//		}
-	//	}
-	//}
+	// starts replaying the events of a move the board core has already resolved
+	void Replay(const CascadeReport& report) {
+		pending = report;
+		nextEvent = 0;
+		NextLink();
+	}
 
-	bool hasThree(int x1, int y1)
-	{
-		int shape1 = objectgrid[x1][y1]->getID();
+	// applies the swap of the next link and starts shrinking its cleared gems
+	void NextLink() {
+		if (nextEvent == events.size())
+		{
+			phase = REPLAY_IDLE;
+			events.clear();
+			if (pending.chain > 0)
+			{
+				score += pending.score;
+				printf("chain of %d, %d gems, +%d, score %d\n", pending.chain, pending.cleared, pending.score, score);
+			}
+			return;
+		}
+		link = events[nextEvent].link;
+		for (; nextEvent < events.size() && events[nextEvent].link == link && events[nextEvent].type != EVENT_FALL
+			&& events[nextEvent].type != EVENT_SPAWN; nextEvent++)
+		{
+			CascadeEvent& e = events[nextEvent];
+			if (e.type == EVENT_SWAP)
+			{
+				Object* obj = Cell(e.u, e.v);
+				vec2 pos = obj->getPosition();
+				obj->setPosition(Cell(e.i, e.j)->getPosition());
+				Cell(e.i, e.j)->setPosition(pos);
+				Cell(e.u, e.v) = Cell(e.i, e.j);
+				Cell(e.i, e.j) = obj;
+			}
+			if (e.type == EVENT_CLEAR) Cell(e.i, e.j)->DeleteBlock();
+		}
+		phase = REPLAY_CLEARING;
+	}
 
-		int count = 0;
-		for (int i = x1 - 2; i <= x1 + 2; i++)
+	// moves the objects by the falls and spawns of the current link. The cleared
+	// objects of a column come back as its new gems, stacked above the board.
+	void ApplyFalls() {
+		std::vector<Object*> moved = objectgrid;
+		std::vector<std::vector<Object*> > freed(layout.width);
+		for (int i = 0; i < layout.width; i++)
+			for (int j = 0; j < layout.height; j++)
+				if (Cell(i, j)->isDeleted()) freed[i].push_back(Cell(i, j));
+		for (; nextEvent < events.size() && events[nextEvent].link == link; nextEvent++)
 		{
-			if ((i != x1) && (i <= 9) && (i >= 0)) {
-				if (shape1 == objectgrid[i][y1]->getID())
-				{
-					count++;
-					if (count == 2) return true;
-				}
-				else count = 0;
+			CascadeEvent& e = events[nextEvent];
+			if (e.type == EVENT_FALL) moved[layout.Index(e.i, e.v)] = Cell(e.i, e.j);
+			if (e.type == EVENT_SPAWN)
+			{
+				Object* object = freed[e.i].back();
+				freed[e.i].pop_back();
+				object->Reset(ShaderOf(e.ID), meshes[e.ID - 1], layout.CellPosition(e.i, e.v),
+					vec2(layout.GemScale(), layout.GemScale()), e.ID);
+				moved[layout.Index(e.i, e.j)] = object;
 			}
 		}
+		objectgrid.swap(moved);
+		phase = REPLAY_FALLING;
+	}
 
-		for (int i = y1 - 2; i <= y1 + 2; i++)
+	// clears cells that did not match, the 'b' key and the quake
+	void ClearCells(const std::vector<int>& cells) {
+		CascadeReport report = board->ClearAndResolve(cells, &events);
+		Replay(report);
+	}
+
+	// copies the cells into the back snapshot and hands it to Draw, along with
+	// the cells that changed since the last snapshot the renderer applied
+	void Publish() {
+		SceneSnapshot& snapshot = snapshots.Back();
+		snapshot.cells.resize(objectgrid.size());
+		snapshot.tick = ticks;
+		if (published.empty())
 		{
-			if ((i <= 9) && (i >= 0) && (i != y1)) {
-				if (shape1 == objectgrid[x1][i]->getID())
+			published.resize(objectgrid.size(), CellSnapshot{ -1, 0, 0, 0, 0 });
+			columnChanges.resize(layout.width);
+		}
+		jobs->ParallelFor(0, layout.width, std::max(1, parallelCells / layout.height), [&](int i) {
+			columnChanges[i].clear();
+			for (int j = 0; j < layout.height; j++)
+			{
+				Object* object = Cell(i, j);
+				int index = layout.Index(i, j);
+				CellSnapshot& cell = snapshot.cells[index];
+				vec2 position = object->getPosition();
+				cell.ID = object->getID();
+				cell.x = position.x;
+				cell.y = position.y;
+				cell.scale = object->getScale().x;
+				cell.orientation = object->getOrientation();
+				if (!(cell == published[index]))
 				{
-					count++;
-					if (count == 2) return true;
+					published[index] = cell;
+					columnChanges[i].push_back(index);
 				}
-				else count = 0;
+			}
+		});
+
+		// the renderer may skip snapshots, so changes are kept until it has applied a later one
+		long long applied = textureTick.load(std::memory_order_acquire);
+		while (!unseen.empty() && unseen.front().first <= applied)
+		{
+			unseenCells -= unseen.front().second.size();
+			unseen.pop_front();
+		}
+		unseen.push_back(std::make_pair(ticks, std::vector<int>()));
+		for (int i = 0; i < layout.width; i++)
+			unseen.back().second.insert(unseen.back().second.end(), columnChanges[i].begin(), columnChanges[i].end());
+		unseenCells += unseen.back().second.size();
+		if (unseenCells > snapshot.cells.size() / 4)
+		{
+			unseen.clear();
+			unseenCells = 0;
+			everythingUntil = ticks;
+		}
+
+		snapshot.everything = applied < everythingUntil;
+		snapshot.changed.clear();
+		if (!snapshot.everything)
+			for (int k = 0; k < unseen.size(); k++)
+				snapshot.changed.insert(snapshot.changed.end(), unseen[k].second.begin(), unseen[k].second.end());
+		snapshots.Publish();
+	}
+
+	// queues an input event for the next tick; called from the GLUT thread only
+	void Post(InputType type, unsigned char key, int i = 0, int j = 0) {
+		double time = std::chrono::duration<double>(std::chrono::steady_clock::now() - epoch).count();
+		if (!input.Push(InputEvent{ type, key, i, j, time, 0 })) printf("input queue full, event dropped\n");
+	}
+
+	// applies the events posted since the last tick, in the order they happened
+	void ReadInput() {
+		InputEvent event;
+		while (input.Pop(event))
+		{
+			event.tick = ticks;
+			if (recording) recording->events.push_back(event);
+			switch (event.type)
+			{
+			case INPUT_KEY_DOWN:
+				held[event.key] = true;
+				if (event.key == 'h') Hint();
+				if (event.key == 'g') Advise();
+				if (event.key == 'e') Search();
+				if (event.key == 'r') ToggleReplay();
+				break;
+			case INPUT_KEY_UP:
+				held[event.key] = false;
+				break;
+			case INPUT_MOUSE_DOWN:
+				Select(event.i, event.j);
+				break;
+			case INPUT_MOUSE_UP:
+				Swap(event.i, event.j);
+				break;
 			}
 		}
+	}
 
-		return false;
+	// one simulation tick, published for Draw
+	void Update() {
+		ReadInput();
+		Step();
+		ticks++;
+		Publish();
 	}
 
-	bool isLegal(int i, int j, int u, int v) {
-		return hasThree(i, j) || hasThree(u, v);
+	void Step() {
+		float respawnScale = layout.GemScale() * 0.2f;
+		float fallSpeed = layout.cellSize * 0.02f;
+		std::atomic<bool> falling(false), shrinking(false);
+		// columns are independent, so a large board spreads them over the job system
+		jobs->ParallelFor(0, layout.width, std::max(1, parallelCells / layout.height), [&](int i) {
+			for (int j = 0; j < layout.height; j++)
+			{
+				Object* object = Cell(i, j);
+				object->CheckD();
+				if (object->isDeleted() && object->getScale().x >= respawnScale) shrinking = true;
+
+				// gems above their cell fall into it
+				vec2 position = object->getPosition(), target = layout.CellPosition(i, j);
+				if (position.y > target.y)
+				{
+					position.y = position.y - fallSpeed > target.y ? position.y - fallSpeed : target.y;
+					object->setPosition(position);
+					falling = true;
+				}
+			}
+		});
+
+		if (phase == REPLAY_CLEARING && !shrinking) ApplyFalls();
+		else if (phase == REPLAY_FALLING && !falling) NextLink();
+
+		if (phase != REPLAY_IDLE) return;
+
+		// a board without moves is reshuffled
+		if (!board->HasLegalMoves()) Shuffle();
+
+		std::vector<int> cleared;
+		if (held['b']) cleared.push_back(layout.Index(currentI, currentJ));
+		if (held['q']) {
+			for (int i = 0; i < objectgrid.size(); i++) {
+				int ran = random.Below(5000);
+				if (ran == 1) {
+					cleared.push_back(i);
+				}
+			}
+		}
+		if (!cleared.empty()) ClearCells(cleared);
 	}
 
+	//void SetOrientation(double t) {
+	//	for (int i = 0; i < 10; i++) {
+	//		for (int j = 0; j < 10; j++) {
+	//			if (shapes[i][j] == 3) {
+	//				objects[i][j]->SetOrientation(t);
+	//			}
+	//		}
+	//	}
+	//}
+
 	void Select(int u, int v) {
 		currentI = u;
 		currentJ = v;
 	}
 
 	void Swap(int u, int v) {
-		int diffX = abs(u - currentI);
-		int diffY = abs(v - currentJ);
+		// the board core is already ahead while a move is replayed
+		if (phase != REPLAY_IDLE) return;
+		// only neighbors, and only if the swap makes a match
+		CascadeReport report = board->Play(currentI, currentJ, u, v, &events);
+		if (report.chain > 0) Replay(report);
+	}
 
-		if (((diffX == 1) && !diffY) || ((diffY == 1) && !diffX))
-			// check to make sure shapes are neighboring
-		{
-			Object* obj = objectgrid[u][v];
-			vec2 pos = obj->getPosition();
 
-			objectgrid[u][v]->setPosition(objectgrid[currentI][currentJ]->getPosition());
-			objectgrid[currentI][currentJ]->setPosition(pos);
 
-			objectgrid[u][v] = objectgrid[currentI][currentJ];
-			objectgrid[currentI][currentJ] = obj;
+	// every cell in instanced batches from a single empty vao, no per-cell buffers or draws.
+	// Each gem type fills its own batch, so no instance runs more vertices than its shape has.
+	void DrawProcedural(const SceneSnapshot& view)
+	{
+		const int batchSize = proceduralShader::batchSize;
+		float cells[gemShapeCount][batchSize * 4];
+		int counts[gemShapeCount] = { 0 };
 
-			if (!isLegal(currentI, currentJ, u, v)) // make sure swap is Legal, if not swap em back
+		pShader->Run();
+		mat4 V = camera.GetViewTransformationMatrix();
+		pShader->UploadM(V);
+		pShader->UploadHeartSegments(Heart::getSegments());
+		procedural->SetHeartSegments(Heart::getSegments());
+
+		int i0, i1, j0, j1;
+		VisibleCells(i0, i1, j0, j1);
+		for (int i = i0; i <= i1; i++)
+			for (int j = j0; j <= j1; j++)
+			{
+				const CellSnapshot& cell = view.cells[layout.Index(i, j)];
+				if (cell.ID <= 0 || cell.ID >= gemShapeCount) continue;	// empty cells have no shape
+				float* batch = cells[cell.ID];
+				int& count = counts[cell.ID];
+				batch[count * 4] = cell.x;
+				batch[count * 4 + 1] = cell.y;
+				batch[count * 4 + 2] = cell.scale;
+				batch[count * 4 + 3] = cell.orientation + spinAngle(cell.ID, view.tick);
+				if (++count == batchSize)
+				{
+					pShader->UploadCells(batch, cell.ID, count);
+					procedural->DrawInstances(cell.ID, count);
+					count = 0;
+				}
+			}
+		for (int type = 1; type < gemShapeCount; type++)
+			if (counts[type] > 0)
 			{
-				Object* obj = objectgrid[u][v];
-				objectgrid[u][v] = objectgrid[currentI][currentJ];
-				objectgrid[currentI][currentJ] = obj;
-
-				vec2 position = objectgrid[u][v]->getPosition();
-				vec2 position2 = objectgrid[currentI][currentJ]->getPosition();
-				objectgrid[u][v]->setPosition(position2);
-				objectgrid[currentI][currentJ]->setPosition(position);
+				pShader->UploadCells(cells[type], type, counts[type]);
+				procedural->DrawInstances(type, counts[type]);
 			}
+	}
+
+	// brings the CPU copy of the board texture up to the snapshot and tells Publish
+	// how far it got. Only the cells the snapshot lists as changed are visited,
+	// all of them after a long gap.
+	void RefreshTexture(const SceneSnapshot& view)
+	{
+		if (view.tick == textureTick.load(std::memory_order_relaxed)) return;
+		if (view.everything)
+		{
+			// rows keep their own dirty spans, so they are filled in parallel
+			jobs->ParallelFor(0, layout.height, std::max(1, parallelCells / layout.width), [&](int j) {
+				for (int i = 0; i < layout.width; i++)
+				{
+					const CellSnapshot& cell = view.cells[layout.Index(i, j)];
+					boardTexture->SetCell(i, j, cell.ID, cell.scale, cell.orientation);
+				}
+			});
 		}
+		else
+			for (int k = 0; k < view.changed.size(); k++)
+			{
+				int index = view.changed[k];
+				const CellSnapshot& cell = view.cells[index];
+				boardTexture->SetCell(index / layout.height, index % layout.height, cell.ID, cell.scale, cell.orientation);
+			}
+		textureTick.store(view.tick, std::memory_order_release);
+	}
 
+	// the board as a texture in a single full-screen pass, only changed cells are uploaded
+	void DrawTexture(const SceneSnapshot& view)
+	{
+		boardTexture->Flush();
 
+		tShader->Run();
+		mat4 invV = camera.getInverseViewTransformationMatrix();
+		tShader->UploadM(invV);
+		tShader->UploadTicks(view.tick);
+		boardTexture->Draw();
 	}
 
+	// one cached buffer per visible chunk, rebuilt only if a cell inside it changed
+	void DrawChunks(const SceneSnapshot& view)
+	{
+		int i0, i1, j0, j1;
+		VisibleCells(i0, i1, j0, j1);
+		if (i0 > i1 || j0 > j1) return;
+
+		cShader->Run();
+		mat4 V = camera.GetViewTransformationMatrix();
+		cShader->UploadM(V);
+		cShader->UploadTicks(view.tick);
+
+		// chunks are refreshed and rebuilt on the job system, uploaded and drawn here
+		const int size = BoardChunk::size;
+		std::vector<int> visible;
+		for (int ci = i0 / size; ci <= i1 / size; ci++)
+			for (int cj = j0 / size; cj <= j1 / size; cj++)
+				visible.push_back(cj * chunkColumns + ci);
+		jobs->ParallelFor(0, (int)visible.size(), std::max(1, parallelCells / (size * size)), [&](int k) {
+			int ci = visible[k] % chunkColumns, cj = visible[k] / chunkColumns;
+			BoardChunk* chunk = chunks[visible[k]];
+			for (int i = ci * size; i < (ci + 1) * size && i < layout.width; i++)
+				for (int j = cj * size; j < (cj + 1) * size && j < layout.height; j++)
+				{
+					const CellSnapshot& cell = view.cells[layout.Index(i, j)];
+					chunk->SetCell(i - ci * size, j - cj * size, geometries[cell.ID - 1], cell.ID,
+						vec2(cell.x, cell.y), cell.scale, cell.orientation);
+				}
+			if (chunk->isDirty()) chunk->Build();
+		});
+		for (int k = 0; k < visible.size(); k++) chunkMeshes[visible[k]]->Draw();
+	}
 
+	void Resize(int width, int height)
+	{
+		compositor->Resize(width, height);
+	}
 
+	// draws the newest snapshot, never the objects the simulation is working on,
+	// and tells the background scheduler when the frame was drawn
 	void Draw()
 	{
-		for (int i = 0; i < 10; i++)
-			for (int j = 0; j < 10; j++)
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		const SceneSnapshot& view = snapshots.Latest();
+		// every snapshot's changes are applied, the texture may be drawn later
+		RefreshTexture(view);
+		Heart::SelectLod(layout.GemScale() * camera.getPixelsPerUnit());
+
+		compositor->DrawStatic();
+
+		if (renderMode == RENDER_CHUNKS) DrawChunks(view);
+		else if (renderMode == RENDER_PROCEDURAL) DrawProcedural(view);
+		else if (renderMode == RENDER_TEXTURE) DrawTexture(view);
+		else DrawObjects(view);
+		spare.Drew(start, std::chrono::steady_clock::now());
+	}
+
+	// every cell with the mesh of its gem type, a draw call each
+	void DrawObjects(const SceneSnapshot& view)
+	{
+		int i0, i1, j0, j1;
+		VisibleCells(i0, i1, j0, j1);
+		for (int i = i0; i <= i1; i++)
+			for (int j = j0; j <= j1; j++)
 			{
-				if (objectgrid[i][j]->getID() == 6) {
+				const CellSnapshot& cell = view.cells[layout.Index(i, j)];
+				Object* stamp = stamps[cell.ID - 1];
+				stamp->Reset(ShaderOf(cell.ID), meshes[cell.ID - 1], vec2(cell.x, cell.y), vec2(cell.scale, cell.scale), cell.ID);
+				stamp->setOrientation(cell.orientation + spinAngle(cell.ID, view.tick));
+				if (cell.ID == 6) {
 					hShader->Run();
 				}
 				else {
 					shader->Run();
 				}
-				objectgrid[i][j]->Draw();
+				stamp->Draw();
 			}
 	}
 };
@@ -1266,20 +5533,34 @@ public:
 
 Scene *scene;
 
+// set from the command line: Project2 [width height [gem types [seed]]]
+int boardWidth = 10, boardHeight = 10, boardGemTypes = 6;
+unsigned long long boardSeed;
+
 void onKeyboard(unsigned char key, int x, int y)
 {
 	keyboardState[key] = true;
+	if (key == 'm') scene->NextRenderMode();
+	if (key == 'u')
+	{
+		jobs->PrintUtilization();
+		printf("AI:\n");
+		aiJobs->PrintUtilization();
+	}
+	scene->Post(INPUT_KEY_DOWN, key);
 }
 
 void onKeyboardUp(unsigned char key, int x, int y)
 {
 	keyboardState[key] = false;
+	scene->Post(INPUT_KEY_UP, key);
 }
 
 void onReshape(int winWidth0, int winHeight0)
 {
 	camera.SetAspectRatio(winWidth0, winHeight0);
 	glViewport(0, 0, winWidth0, winHeight0);
+	if (scene) scene->Resize(winWidth0, winHeight0);
 	glutPostRedisplay();
 }
 
@@ -1295,17 +5576,17 @@ void onMouse(int button, int state, int i, int j)
 
 	vec4 p = vec4(x, y, 0, 1) * invV;
 
-	int u = (int)floor((p.v[0] + 1.0) * 5.0);
-	int v = (int)floor((p.v[1] + 1.0) * 5.0);
+	int u, v;
+	bool onBoard = scene->PickCell(vec2(p.v[0], p.v[1]), u, v);
 
 	printf("%i %i\n", u, v);
 
-	if ((u < 0) || (u > 9) || (v < 0) || (v > 9)) return;
+	if (!onBoard) return;
 
 	if (state == GLUT_DOWN)
-		scene->Select(u, v);
+		scene->Post(INPUT_MOUSE_DOWN, 0, u, v);
 	if (state == GLUT_UP)
-		scene->Swap(u, v);
+		scene->Post(INPUT_MOUSE_UP, 0, u, v);
 }
 
 void onIdle() {
@@ -1333,10 +5614,11 @@ void onIdle() {
 	//triangle1.Rotate(dt);
 	//triangle2.Move(sin(t));
 
+	if (keyboardState['q']) camera.Quake(sin(t * 100));
 	camera.Move(dt);
 
+	// the board itself moves on the simulation thread
 	scene->HeartBeat(t);
-	scene->Update();
 
 	glutPostRedisplay();
 }
@@ -1374,7 +5656,9 @@ void onInitialization()
 	//    gMesh = new Mesh(gGeometry, gMaterial);
 	//    gObject = new Object(gShader, gMesh, vec2(-0.5, -0.5),
 	//                         vec2(0.5, 1.0), -30.0);
-	scene = new Scene();
+	jobs = new JobSystem(std::thread::hardware_concurrency());
+	aiJobs = new JobSystem(std::thread::hardware_concurrency());
+	scene = new Scene(boardWidth, boardHeight, boardGemTypes, boardSeed);
 	scene->Initialize();
 
 	//    gShader->Run();
@@ -1405,9 +5689,56 @@ void onDisplay()
 }
 
 
+// reads width height [gem types [seed]] from the first of args; false if the size is out of range
+bool ReadBoardArguments(int argc, char * argv[])
+{
+	if (argc >= 2)
+	{
+		boardWidth = atoi(argv[0]);
+		boardHeight = atoi(argv[1]);
+	}
+	if (argc >= 3) boardGemTypes = atoi(argv[2]);
+	// every session is reproducible from the seed it prints
+	boardSeed = argc >= 4 ? strtoull(argv[3], NULL, 10) : (unsigned long long)time(NULL);
+	printf("seed %llu\n", boardSeed);
+	if (boardWidth < 3 || boardHeight < 3 || boardWidth > 4096 || boardHeight > 4096)
+	{
+		printf("board size must be between 3 and 4096\n");
+		return false;
+	}
+	if (boardGemTypes < 3) boardGemTypes = 3;
+	if (boardGemTypes > gemShapeCount - 1) boardGemTypes = gemShapeCount - 1;
+	return true;
+}
+
+// Project2 --simulate games policy [width height [gem types [seed]]] plays headless games and exits
+int Simulate(int argc, char * argv[])
+{
+	SimulationConfig config;
+	config.games = argc >= 4 ? atoll(argv[2]) : 0;
+	config.policy = POLICY_COUNT;
+	for (int k = 0; k < POLICY_COUNT && argc >= 4; k++)
+		if (strcmp(argv[3], policyNames[k]) == 0) config.policy = (SimulationPolicy)k;
+	if (config.policy == POLICY_COUNT || config.games < 1)
+	{
+		printf("usage: Project2 --simulate games random|greedy|advisor [width height [gem types [seed]]]\n");
+		return 1;
+	}
+	if (!ReadBoardArguments(argc - 4, argv + 4)) return 1;
+	config.width = boardWidth;
+	config.height = boardHeight;
+	config.colors = boardGemTypes;
+	jobs = new JobSystem(std::thread::hardware_concurrency());
+	RunSimulation(config, *jobs, boardSeed);
+	delete jobs;
+	return 0;
+}
+
 int main(int argc, char * argv[])
 {
+	if (argc >= 2 && strcmp(argv[1], "--simulate") == 0) return Simulate(argc, argv);
 	glutInit(&argc, argv);
+	if (!ReadBoardArguments(argc - 1, argv + 1)) return 1;
 #if !defined(_APPLE_)
 	glutInitContextVersion(majorVersion, minorVersion);
 #endif
@@ -1433,6 +5764,7 @@ int main(int argc, char * argv[])
 	printf("GLSL Version : %s\n", glGetString(GL_SHADING_LANGUAGE_VERSION));
 
 	onInitialization();
+	scene->Start();
 
 	glutDisplayFunc(onDisplay); // register event handlers
 	glutIdleFunc(onIdle);
@@ -1445,3 +5777,9 @@ int main(int argc, char * argv[])
 	return 1;
 }
 
+// GCC checks the vector returns of VectorLanes and LaneKernels against the baseline
+// ABI only once the whole file is read, and reports them at its end. They are all
+// inlined into the kernels of their instruction set, so there is no ABI to keep.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wpsabi"
+#endif